@@ -1,4 +1,4 @@
 #!/bin/bash
 
-dd if=/dev/zero of=disk1.img bs=1M count=1
-dd if=/dev/zero of=disk2.img bs=1M count=1
+truncate -s 1M disk1.img
+truncate -s 1M disk2.img
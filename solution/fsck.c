@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "wfs.h"
+
+/*
+  fsck.wfs: offline consistency checker for wfs disk arrays.
+
+  All images are mapped and the work is split across worker threads:
+  first the directory tree is walked level by level from the root to find
+  reachable inodes, following the block trees of large directories, then
+  the inode table is scanned in ranges to count the references reachable
+  inodes make to every data block. A leaked inode's blocks are therefore
+  unreferenced and go with it. Both results are cross-checked against the bitmaps, and
+  the mirrored regions are compared across disks. With a metadata tier
+  the inode table and dentry blocks are read from the first metadata
+  image and compared across the others.
+  With -y leaked inodes and data blocks are released in the bitmaps and
+  the superblock free space counters are rewritten from them.
+*/
+
+#define FSCK_OK         0
+#define FSCK_CORRECTED  1
+#define FSCK_UNCORRECTED 4
+
+void **disk_ptrs;
+size_t *disk_sizes;
+int total_disks;
+int meta_disks;
+int itable;                 // first disk holding the inode table: a metadata image if there are any
+int icopies;                // copies of the inode table
+DiskMode raid;
+struct wfs_sb sb;
+size_t islotsize;
+int nthreads;
+int repair;
+
+unsigned char *reached;     // per inode: reachable from the root
+unsigned char *brefs;       // per data block: references from live inodes, saturating
+int *frontier, *next;       // directory walk, one level at a time
+long nfrontier, nnext;
+long errors;
+long fixed;
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void report(const char *fmt, long a, long b) {
+    pthread_mutex_lock(&report_lock);
+    printf(fmt, a, b);
+    errors++;
+    pthread_mutex_unlock(&report_lock);
+}
+
+long min(long a, long b) {
+    return a < b ? a : b;
+}
+
+int bit_set(const unsigned char *bitmap, long i) {
+    return (bitmap[i / 8] & (1 << (i % 8))) != 0;
+}
+
+void clear_bit(unsigned char *bitmap, long i) {
+    bitmap[i / 8] &= ~(1 << (i % 8));
+}
+
+// same mapping as wfs: RAID0 stripes block numbers across the disks,
+// the old disk count past the cursor of an unfinished restripe
+int stripe_width(long dnum) {
+    return sb.restripe_from != 0 && dnum >= sb.restripe_pos ? sb.restripe_from : total_disks;
+}
+
+int block_disk(long dnum) {
+    return raid == RAID_0 ? dnum % stripe_width(dnum) : 0;
+}
+
+long block_offset(long dnum) {
+    return dnum / stripe_width(dnum);
+}
+
+// index into brefs, one range of num_data_blocks per disk, then the dentry blocks of a metadata tier
+long block_index(long dnum) {
+    if (dnum >= META_BASE) {
+        return (long)total_disks * sb.num_data_blocks + dnum - META_BASE;
+    }
+    return (long)block_disk(dnum) * sb.num_data_blocks + block_offset(dnum);
+}
+
+// RAID0 keeps a data bitmap per disk, mirrored modes share the main one
+unsigned char* dbitmap(int disk) {
+    return (unsigned char*)disk_ptrs[raid == RAID_0 ? disk : 0] + sb.d_bitmap_ptr;
+}
+
+struct wfs_inode* inode_at(int disk, long inum) {
+    return (struct wfs_inode*)((off_t)disk_ptrs[disk] + sb.i_blocks_ptr + inum * islotsize);
+}
+
+void* block_at(long dnum) {
+    if (dnum >= META_BASE) {
+        return (void*)((off_t)disk_ptrs[itable] + sb.d_blocks_ptr + (dnum - META_BASE) * BLOCK_SIZE);
+    }
+    return (void*)((off_t)disk_ptrs[block_disk(dnum)] + sb.d_blocks_ptr + block_offset(dnum) * BLOCK_SIZE);
+}
+
+int valid_block(long dnum) {
+    if (dnum >= META_BASE) {
+        return dnum - META_BASE < (long)sb.meta_blocks;
+    }
+    return dnum >= 0 && block_offset(dnum) < sb.disk_blocks[block_disk(dnum)];
+}
+
+struct range {
+    pthread_t thread;
+    long start;
+    long end;
+};
+
+// call fn on the pointer blocks and, with leaf set, the dentry blocks of a tree directory
+void for_tree(struct wfs_inode *dir, long owner, void (*fn)(long owner, long dnum, int leaf)) {
+    int *index, *ptrs;
+
+    index = block_at(dir->blocks[IND_BLOCK]);
+    for (int k = 0; k < DIR_FANOUT; k++) {
+        if (index[k] == -1) {
+            continue;
+        }
+        fn(owner, index[k], 0);
+        if (!valid_block(index[k])) {
+            continue;
+        }
+        ptrs = block_at(index[k]);
+        for (int j = 0; j < DIR_FANOUT; j++) {
+            if (ptrs[j] != -1) {
+                fn(owner, ptrs[j], 1);
+            }
+        }
+    }
+}
+
+void count_ref(long i, long dnum, int leaf) {
+    if (!valid_block(dnum)) {
+        report("inode %ld: block pointer %ld out of range\n", i, dnum);
+        return;
+    }
+    unsigned char old = __atomic_load_n(&brefs[block_index(dnum)], __ATOMIC_RELAXED);
+    while (old < 255 && !__atomic_compare_exchange_n(&brefs[block_index(dnum)], &old, old + 1, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// phase 2: count data block references of reachable inodes in [start, end)
+void* scan_inodes(void *arg) {
+    struct range *r = arg;
+    const unsigned char *ibitmap = (unsigned char*)disk_ptrs[itable] + sb.i_bitmap_ptr;
+    struct wfs_inode *inode;
+
+    for (long i = r->start; i < r->end; i++) {
+        if (!bit_set(ibitmap, i) || !reached[i]) {
+            continue;
+        }
+        // malformed inodes are reported with the leaks below
+        inode = inode_at(itable, i);
+        if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+            continue;
+        }
+        for (int k = 0; k < N_BLOCKS; k++) {
+            if (inode->blocks[k] != -1) {
+                count_ref(i, inode->blocks[k], 0);
+            }
+        }
+        if (S_ISDIR(inode->mode) && (inode->mode & WFS_S_DIRTREE) && valid_block(inode->blocks[IND_BLOCK])) {
+            for_tree(inode, i, count_ref);
+        }
+    }
+    return NULL;
+}
+
+// the entries of one dentry block of directory parent
+void walk_block(long parent, long dnum, int leaf) {
+    const unsigned char *ibitmap = (unsigned char*)disk_ptrs[itable] + sb.i_bitmap_ptr;
+    struct wfs_inode *child;
+    struct wfs_dentry *dentry;
+
+    if (!leaf || !valid_block(dnum)) {
+        return;
+    }
+    dentry = block_at(dnum);
+    for (int d = 0; d < BLOCK_SIZE / sizeof(struct wfs_dentry); d++, dentry++) {
+        long c = dentry->num;
+        if (c == -1) {
+            continue;
+        }
+        if (c < 0 || c >= sb.num_inodes) {
+            report("dir %ld: entry points at inode %ld\n", parent, c);
+            continue;
+        }
+        if (!bit_set(ibitmap, c)) {
+            report("dir %ld: entry points at free inode %ld\n", parent, c);
+            continue;
+        }
+        // first visitor owns the inode; later links are reported as extra
+        if (__atomic_exchange_n(&reached[c], 1, __ATOMIC_RELAXED)) {
+            report("inode %ld: linked more than once (from dir %ld)\n", c, parent);
+            continue;
+        }
+        child = inode_at(itable, c);
+        if (S_ISDIR(child->mode)) {
+            next[__atomic_fetch_add(&nnext, 1, __ATOMIC_RELAXED)] = c;
+        }
+    }
+}
+
+// phase 1: expand the directories in frontier[start, end) into next
+void* walk_dirs(void *arg) {
+    struct range *r = arg;
+    struct wfs_inode *dir;
+
+    for (long f = r->start; f < r->end; f++) {
+        dir = inode_at(itable, frontier[f]);
+        for (int k = 0; k < N_BLOCKS; k++) {
+            if (k == IND_BLOCK && (dir->mode & WFS_S_DIRTREE)) {
+                if (valid_block(dir->blocks[k])) {
+                    for_tree(dir, frontier[f], walk_block);
+                }
+                continue;
+            }
+            if (dir->blocks[k] != -1) {
+                walk_block(frontier[f], dir->blocks[k], 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// run fn over [0, n) split evenly across the worker threads
+void parallel(void* (*fn)(void*), long n) {
+    struct range ranges[nthreads];
+    long chunk = (n + nthreads - 1) / nthreads;
+
+    for (int t = 0; t < nthreads; t++) {
+        ranges[t].start = min(n, t * chunk);
+        ranges[t].end = min(n, (t + 1) * chunk);
+        if (pthread_create(&ranges[t].thread, NULL, fn, &ranges[t]) != 0) {
+            fn(&ranges[t]);
+            ranges[t].thread = 0;
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        if (ranges[t].thread != 0) {
+            pthread_join(ranges[t].thread, NULL);
+        }
+    }
+}
+
+// report regions whose copies differ between disks
+void compare_mirrors() {
+    const unsigned char *ibitmap = (unsigned char*)disk_ptrs[itable] + sb.i_bitmap_ptr;
+    const unsigned char *db = dbitmap(0);
+    const unsigned char *mb = (unsigned char*)disk_ptrs[itable] + sb.d_bitmap_ptr;
+    off_t off;
+
+    for (int d = itable + 1; d < itable + icopies; d++) {
+        for (long i = 0; i < sb.num_inodes; i++) {
+            if (bit_set(ibitmap, i) && memcmp(inode_at(itable, i), inode_at(d, i), islotsize) != 0) {
+                report("inode %ld: copy on disk %ld differs\n", i, d);
+            }
+        }
+    }
+    for (int d = total_disks + 1; d < total_disks + meta_disks; d++) {
+        for (long i = 0; i < sb.meta_blocks; i++) {
+            off = sb.d_blocks_ptr + i * BLOCK_SIZE;
+            if (bit_set(mb, i) && memcmp((char*)disk_ptrs[itable] + off, (char*)disk_ptrs[d] + off, BLOCK_SIZE) != 0) {
+                report("dentry block %ld: copy on disk %ld differs\n", i, d);
+            }
+        }
+    }
+    for (int d = 1; raid != RAID_0 && d < total_disks; d++) {
+        for (long i = 0; i < sb.num_data_blocks; i++) {
+            off = sb.d_blocks_ptr + i * BLOCK_SIZE;
+            if (bit_set(db, i) && memcmp((char*)disk_ptrs[0] + off, (char*)disk_ptrs[d] + off, BLOCK_SIZE) != 0) {
+                report("block %ld: copy on disk %ld differs\n", i, d);
+            }
+        }
+    }
+}
+
+// clear a bit in the copies of a bitmap on disks [first, first + n)
+void release(off_t bitmap_ptr, int first, int n, long i) {
+    for (int d = first; d < first + n; d++) {
+        clear_bit((unsigned char*)disk_ptrs[d] + bitmap_ptr, i);
+    }
+    fixed++;
+}
+
+// recount the superblock free space counters from the bitmaps
+void check_counters() {
+    const unsigned char *ibitmap = (unsigned char*)disk_ptrs[itable] + sb.i_bitmap_ptr;
+    struct wfs_sb want, have;
+    size_t len = sizeof(struct wfs_sb) - offsetof(struct wfs_sb, free_inodes);
+
+    memcpy(&want, &sb, sizeof(struct wfs_sb));
+    want.free_inodes = 0;
+    want.free_blocks = 0;
+    for (long i = 0; i < sb.num_inodes; i++) {
+        want.free_inodes += !bit_set(ibitmap, i);
+    }
+    for (int d = 0; d < total_disks; d++) {
+        want.disk_free_blocks[d] = 0;
+        for (long o = 0; o < sb.disk_blocks[d]; o++) {
+            want.disk_free_blocks[d] += !bit_set(dbitmap(d), o);
+        }
+        if (raid == RAID_0 || d == 0) {
+            want.free_blocks += want.disk_free_blocks[d];
+        }
+    }
+    // a metadata tier keeps the only current counters
+    for (int d = meta_disks > 0 ? total_disks : 0; d < total_disks + meta_disks; d++) {
+        memcpy(&have, disk_ptrs[d], sizeof(struct wfs_sb));
+        if (memcmp((char*)&have + offsetof(struct wfs_sb, free_inodes), (char*)&want + offsetof(struct wfs_sb, free_inodes), len) == 0) {
+            continue;
+        }
+        report("disk %ld: stale free space counters (%ld free blocks recorded)\n", d, (long)have.free_blocks);
+        if (repair) {
+            memcpy((char*)disk_ptrs[d] + offsetof(struct wfs_sb, free_inodes), (char*)&want + offsetof(struct wfs_sb, free_inodes), len);
+            fixed++;
+        }
+    }
+}
+
+// ./fsck.wfs [-y] [-j threads] disk1 disk2 ...
+int main(int argc, char *argv[]) {
+    int i, fd;
+    int dcnt = 0;
+    struct wfs_sb disk_sb;
+    struct stat st;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    disk_ptrs = calloc(MAX_DISKS + MAX_META, sizeof(void*));
+    disk_sizes = calloc(MAX_DISKS + MAX_META, sizeof(size_t));
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-y") == 0) {
+            repair = 1;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+        }
+        else if (dcnt < MAX_DISKS + MAX_META) {
+            if ((fd = open(argv[i], repair ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+                fprintf(stderr, "fsck: cannot open %s\n", argv[i]);
+                return FSCK_UNCORRECTED;
+            }
+            disk_ptrs[dcnt] = mmap(NULL, st.st_size, PROT_READ | (repair ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+            if (disk_ptrs[dcnt] == MAP_FAILED) {
+                fprintf(stderr, "fsck: cannot map %s\n", argv[i]);
+                return FSCK_UNCORRECTED;
+            }
+            disk_sizes[dcnt++] = st.st_size;
+            close(fd);
+        }
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (dcnt == 0) {
+        fprintf(stderr, "usage: fsck.wfs [-y] [-j threads] disk...\n");
+        return FSCK_UNCORRECTED;
+    }
+
+    // order the images by their position in the array, metadata images last
+    void *ordered[MAX_DISKS + MAX_META] = {0};
+    size_t ordered_sizes[MAX_DISKS + MAX_META];
+    memcpy(&sb, disk_ptrs[0], sizeof(struct wfs_sb));
+    if (sb.num_disks + sb.num_meta != dcnt) {
+        fprintf(stderr, "fsck: array has %zu disks, %d given\n", sb.num_disks + sb.num_meta, dcnt);
+        return FSCK_UNCORRECTED;
+    }
+    for (i = 0; i < dcnt; i++) {
+        memcpy(&disk_sb, disk_ptrs[i], sizeof(struct wfs_sb));
+        int slot = -1;
+        for (int k = 0; k < sb.num_disks; k++) {
+            if (strcmp(disk_sb.id, sb.disks[k]) == 0) {
+                slot = k;
+            }
+        }
+        for (int k = 0; k < sb.num_meta; k++) {
+            if (strcmp(disk_sb.id, sb.metas[k]) == 0) {
+                slot = sb.num_disks + k;
+            }
+        }
+        if (slot == -1 || ordered[slot] != NULL) {
+            fprintf(stderr, "fsck: disk %d does not belong to this array\n", i);
+            return FSCK_UNCORRECTED;
+        }
+        ordered[slot] = disk_ptrs[i];
+        ordered_sizes[slot] = disk_sizes[i];
+    }
+    memcpy(disk_ptrs, ordered, sizeof(ordered));
+    memcpy(disk_sizes, ordered_sizes, sizeof(ordered_sizes));
+    total_disks = sb.num_disks;
+    meta_disks = sb.num_meta;
+    itable = meta_disks > 0 ? total_disks : 0;
+    icopies = meta_disks > 0 ? meta_disks : total_disks;
+    // the superblock of record, whose free space counters are current
+    memcpy(&sb, disk_ptrs[itable], sizeof(struct wfs_sb));
+    raid = sb.raid;
+    islotsize = (sb.flags & WFS_F_COMPACT) ? sizeof(struct wfs_inode) : BLOCK_SIZE;
+    for (i = 0; i < dcnt; i++) {
+        if (disk_sizes[i] < sb.d_blocks_ptr + (i < total_disks ? sb.disk_blocks[i] : sb.meta_blocks) * BLOCK_SIZE) {
+            fprintf(stderr, "fsck: disk %d is smaller than the filesystem\n", i);
+            return FSCK_UNCORRECTED;
+        }
+    }
+
+    reached = calloc(sb.num_inodes, 1);
+    brefs = calloc(sb.num_data_blocks * total_disks + sb.meta_blocks, 1);
+    frontier = malloc(sb.num_inodes * sizeof(int));
+    next = malloc(sb.num_inodes * sizeof(int));
+
+    reached[0] = 1;
+    frontier[0] = 0;
+    nfrontier = 1;
+    while (nfrontier > 0) {
+        nnext = 0;
+        parallel(walk_dirs, nfrontier);
+        int *tmp = frontier;
+        frontier = next;
+        next = tmp;
+        nfrontier = nnext;
+    }
+    parallel(scan_inodes, sb.num_inodes);
+
+    // inodes: allocated but unreachable are leaks, reachable ones must be well formed
+    const unsigned char *ibitmap = (unsigned char*)disk_ptrs[itable] + sb.i_bitmap_ptr;
+    struct wfs_inode *inode;
+    for (long n = 0; n < sb.num_inodes; n++) {
+        if (!bit_set(ibitmap, n)) {
+            continue;
+        }
+        inode = inode_at(itable, n);
+        if (!reached[n]) {
+            report("inode %ld: allocated but not reachable (mode %lo)\n", n, (long)inode->mode);
+            if (repair) {
+                release(sb.i_bitmap_ptr, itable, icopies, n);
+            }
+        }
+        else if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+            report("inode %ld: bad mode %lo\n", n, (long)inode->mode);
+        }
+        else if (inode->num != n) {
+            report("inode %ld: number field is %ld\n", n, (long)inode->num);
+        }
+    }
+
+    // data blocks: referenced-but-free, shared, and allocated-but-unreferenced
+    for (int d = 0; d < total_disks; d++) {
+        if (raid != RAID_0 && d > 0) {
+            break;
+        }
+        for (long o = 0; o < sb.disk_blocks[d]; o++) {
+            unsigned char refs = brefs[(long)d * sb.num_data_blocks + o];
+            int allocated = bit_set(dbitmap(d), o);
+            if (refs > 0 && !allocated) {
+                report("block %ld on disk %ld: in use but marked free\n", o, d);
+            }
+            else if (refs > 1 && (sb.flags & (WFS_F_DEDUP | WFS_F_SNAPSHOT)) == 0) {
+                report("block %ld on disk %ld: referenced by more than one inode\n", o, d);
+            }
+            else if (refs == 0 && allocated) {
+                report("block %ld on disk %ld: allocated but not referenced\n", o, d);
+                if (repair) {
+                    release(sb.d_bitmap_ptr, d, raid == RAID_0 ? 1 : total_disks, o);
+                }
+            }
+        }
+    }
+    for (long o = 0; o < sb.meta_blocks; o++) {
+        unsigned char refs = brefs[(long)total_disks * sb.num_data_blocks + o];
+        int allocated = bit_set((unsigned char*)disk_ptrs[itable] + sb.d_bitmap_ptr, o);
+        if (refs > 0 && !allocated) {
+            report("dentry block %ld: in use but marked free\n", o, 0);
+        }
+        else if (refs > 1) {
+            report("dentry block %ld: referenced by more than one directory\n", o, 0);
+        }
+        else if (refs == 0 && allocated) {
+            report("dentry block %ld: allocated but not referenced\n", o, 0);
+            if (repair) {
+                release(sb.d_bitmap_ptr, total_disks, meta_disks, o);
+            }
+        }
+    }
+
+    compare_mirrors();
+    check_counters();
+
+    printf("fsck.wfs: %ld inodes, %ld data blocks, %d disks, %d threads: %ld problems, %ld fixed\n",
+           (long)sb.num_inodes, (long)sb.num_data_blocks, total_disks, nthreads, errors, fixed);
+    for (i = 0; repair && i < dcnt; i++) {
+        msync(disk_ptrs[i], disk_sizes[i], MS_SYNC);
+    }
+    if (errors == 0) {
+        return FSCK_OK;
+    }
+    return errors == fixed ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
@@ -1,8 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "wfs.h"
@@ -20,12 +24,258 @@ void generate_id(int disk_index, char *id, size_t size) {
     snprintf(id, size, "%d-%ld-%d", disk_index, (long)ctime, random);
 }
 
-int roundup(int n, int k) {
-    int r = n % k;
+// software CRC32C (Castagnoli), only used for the root inode block
+uint32_t crc32c(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t crc = ~0U;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+long roundup(long n, long k) {
+    long r = n % k;
     if (r == 0) return n;
     return n + k - r;
 }
 
+// parse a size with an optional K, M or G suffix
+long parse_size(const char *str) {
+    char *endptr;
+    long size;
+
+    errno = 0;
+    size = strtol(str, &endptr, 10);
+    if (errno != 0 || endptr == str || size <= 0) return -1;
+    switch (*endptr) {
+        case 'G': size *= 1024;   /* fall through */
+        case 'M': size *= 1024;   /* fall through */
+        case 'K': size *= 1024; endptr++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*endptr != '\0') return -1;
+    return size;
+}
+
+// shared, read-only image contents handed to every format thread
+struct layout {
+    struct wfs_sb sb;
+    unsigned char *inodebitmap;
+    unsigned char *dbitmap;
+    unsigned char *rootslot;
+    long inodesize;
+    long dblocksize;
+    long itablesize;
+    long imagesize;
+};
+
+struct format_job {
+    pthread_t thread;
+    const char *path;
+    const char *id;
+    long blocks;            // data blocks on this disk
+    int itable;             // holds the inode table, 0 for data disks of a metadata tier
+    long totalsize;         // bytes the image needs
+    const struct layout *layout;
+    int status;
+};
+
+// parse a comma separated list of up to max positive numbers; returns the count or -1
+int parse_list(const char *str, long *vals, int max) {
+    char *copy = strdup(str), *endptr;
+    int n = 0;
+
+    for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        errno = 0;
+        if (n == max || (vals[n] = strtol(tok, &endptr, 10)) <= 0 || errno != 0 || *endptr != '\0') {
+            free(copy);
+            return -1;
+        }
+        n++;
+    }
+    free(copy);
+    return n;
+}
+
+long gcd(long a, long b) {
+    return b == 0 ? a : gcd(b, a % b);
+}
+
+// write len bytes to fd at off, as one large transfer
+int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = pwrite(fd, buf, len, off)) <= 0) {
+            return -1;
+        }
+        buf = (const char*)buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+  Formats one disk image. Everything in front of the inode table (superblock
+  and both bitmaps) goes out as one pwrite, then the root inode block and
+  the checksum region, which follows this disk's own data blocks. With -s,
+  missing images are created and short ones extended sparsely with
+  ftruncate instead of being filled with zeros.
+*/
+void* format_disk(void *arg) {
+    struct format_job *job = arg;
+    const struct layout *l = job->layout;
+    struct wfs_sb superblock = l->sb;
+    struct stat st;
+    unsigned char *header;
+    uint32_t *csums = NULL;
+    long csumsize = 0;
+    int fd;
+
+    // checksums: only the root inode block has been written so far
+    if (superblock.flags & WFS_F_CHECKSUM) {
+        superblock.c_blocks_ptr = superblock.d_blocks_ptr + job->blocks * BLOCK_SIZE;
+        csumsize = roundup((l->itablesize / BLOCK_SIZE + job->blocks) * sizeof(uint32_t), BLOCK_SIZE);
+        csums = calloc(1, csumsize);
+        if (job->itable) {
+            csums[0] = crc32c(l->rootslot, BLOCK_SIZE);
+        }
+    }
+    job->totalsize = superblock.d_blocks_ptr + job->blocks * BLOCK_SIZE + csumsize;
+
+    job->status = -1;
+    if ((fd = open(job->path, O_RDWR | (l->imagesize > 0 ? O_CREAT : 0), 0644)) < 0) {
+        free(csums);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        free(csums);
+        close(fd);
+        return NULL;
+    }
+    if (l->imagesize > 0 && st.st_size < l->imagesize) {
+        if (ftruncate(fd, l->imagesize) < 0) {
+            free(csums);
+            close(fd);
+            return NULL;
+        }
+        st.st_size = l->imagesize;
+    }
+    if (st.st_size < job->totalsize) {
+        free(csums);
+        close(fd);
+        return NULL;
+    }
+
+    strcpy(superblock.id, job->id);
+    if ((header = calloc(1, superblock.i_blocks_ptr)) == NULL) {
+        free(csums);
+        close(fd);
+        return NULL;
+    }
+    memcpy(header, &superblock, sizeof(struct wfs_sb));
+    if (job->itable) {
+        memcpy(header + superblock.i_bitmap_ptr, l->inodebitmap, l->inodesize);
+    }
+    memcpy(header + superblock.d_bitmap_ptr, l->dbitmap, l->dblocksize);
+
+    if (pwrite_all(fd, header, superblock.i_blocks_ptr, 0) < 0 ||
+        (job->itable && pwrite_all(fd, l->rootslot, BLOCK_SIZE, superblock.i_blocks_ptr) < 0) ||
+        (csumsize > 0 && pwrite_all(fd, csums, csumsize, superblock.c_blocks_ptr) < 0)) {
+        free(header);
+        free(csums);
+        close(fd);
+        return NULL;
+    }
+    free(header);
+    free(csums);
+    if (close(fd) == 0) {
+        job->status = 0;
+    }
+    return NULL;
+}
+
+/*
+  -w bench: weights each disk by its sequential write throughput. A
+  BENCH_SIZE write and fdatasync go to the start of every formatted
+  image's data region, one disk at a time, for BENCH_ROUNDS rounds. Each
+  disk keeps its best rate, which hides warm-up, and the weights are
+  those rates relative to the fastest disk, in percent. The probed range
+  is punched out again so sparse images stay sparse; nothing is
+  allocated there yet. The weights are then written into every image's
+  superblock, metadata images included, so all copies agree.
+*/
+#define BENCH_SIZE (4L << 20)
+#define BENCH_ROUNDS 3
+
+int calibrate_weights(struct format_job *jobs, int dcnt, int mcnt, struct wfs_sb *sb) {
+    double rate[MAX_DISKS] = {0}, r, best = 0;
+    struct timespec start, end;
+    long len = BENCH_SIZE, g = 0;
+    char *buf;
+    int fd;
+
+    if ((buf = malloc(BENCH_SIZE)) == NULL) {
+        return -1;
+    }
+    memset(buf, 0, BENCH_SIZE);
+    // the same length on every disk, or the fixed sync cost skews small ones
+    for (int i = 0; i < dcnt; i++) {
+        len = jobs[i].blocks * BLOCK_SIZE < len ? jobs[i].blocks * BLOCK_SIZE : len;
+    }
+    for (int k = 0; k < BENCH_ROUNDS * dcnt; k++) {
+        int i = k % dcnt;
+        if ((fd = open(jobs[i].path, O_RDWR)) < 0) {
+            free(buf);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (pwrite_all(fd, buf, len, sb->d_blocks_ptr) < 0 || fdatasync(fd) < 0) {
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, sb->d_blocks_ptr, len);
+        close(fd);
+        r = len / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9 + 1e-9);
+        rate[i] = r > rate[i] ? r : rate[i];
+        best = r > best ? r : best;
+    }
+    free(buf);
+
+    for (int i = 0; i < dcnt; i++) {
+        sb->disk_weights[i] = (int)(100 * rate[i] / best + 0.5);
+        if (sb->disk_weights[i] < 1) {
+            sb->disk_weights[i] = 1;
+        }
+        g = gcd(sb->disk_weights[i], g);
+    }
+    printf("weights:");
+    for (int i = 0; i < dcnt; i++) {
+        sb->disk_weights[i] /= g;
+        printf(" %d (%.0f MB/s)", sb->disk_weights[i], rate[i] / 1e6);
+    }
+    printf("\n");
+    for (int i = 0; i < dcnt + mcnt; i++) {
+        if ((fd = open(jobs[i].path, O_RDWR)) < 0) {
+            return -1;
+        }
+        if (pwrite_all(fd, sb->disk_weights, sizeof(sb->disk_weights), offsetof(struct wfs_sb, disk_weights)) < 0) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     if (argc <= 1) {
         return -1;
@@ -34,13 +284,27 @@ int main(int argc, char *argv[]) {
     int i;
     long inodes = -1;
     long blocks = -1;
+    long disk_blocks[MAX_DISKS];
+    int nblocks = 0;
+    long weights[MAX_DISKS];
+    int nweights = 0;
+    int bench = 0;
     char **disks = calloc(MIN_DISKS, sizeof(char*));
     int ndisks = MIN_DISKS;
     int dcnt = 0;
+    char *metas[MAX_META];
+    int mcnt = 0;
+    long meta_blocks = -1;
     char *endptr, *str;
-    DiskMode raid;
+    DiskMode raid = (DiskMode)-1;
+    int flags = 0;
+    long imagesize = 0;
 
-    // ./mkfs -r 1 -d disk1 -d disk2 -i 32 -b 200
+    // ./mkfs -r 1 -d disk1 -d disk2 -i 32 -b 200 [-f inline,compact,checksum,dedup] [-s 64M]
+    // ./mkfs -r 0 -d disk1 -d disk2 -i 32 -b 200,400 [-w 1,2|bench]
+    // RAID0 disks may differ: -b 200,400 gives each its own size, -w 1,2 or -w bench its stripe weight
+    // ./mkfs -r 0 -d disk1 -d disk2 -m meta1 -m meta2 [-M 64] ... puts all metadata on mirrored meta images,
+    // with -M dentry blocks on each (default: one per inode)
     for (i = 1; i < argc - 1; i++) {
         errno = 0;
         if (strcmp(argv[i], "-r") == 0) {
@@ -58,11 +322,27 @@ int main(int argc, char *argv[]) {
             if (dcnt >= ndisks) {
                 ndisks *= 2;
                 disks = reallocarray(disks, ndisks, sizeof(char*));
+                memset(disks + dcnt, 0, (ndisks - dcnt) * sizeof(char*));
             }
             disks[dcnt] = malloc(strlen(str) + 1);
             strcpy(disks[dcnt], str);
             dcnt++;
         }
+        else if (strcmp(argv[i], "-m") == 0) {
+            if (mcnt >= MAX_META) {
+                freev((void*)disks, ndisks, 1);
+                return 1;
+            }
+            metas[mcnt++] = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-M") == 0) {
+            str = argv[i + 1];
+            meta_blocks = strtol(str, &endptr, 10);
+            if (errno != 0 || endptr == str || *endptr != '\0' || meta_blocks <= 0) {
+                freev((void*)disks, ndisks, 1);
+                return 1;
+            }
+        }
         else if (strcmp(argv[i], "-i") == 0) {
             str = argv[i + 1];
             inodes = strtol(str, &endptr, 10);
@@ -71,10 +351,42 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
         }
+        else if (strcmp(argv[i], "-f") == 0) {
+            // comma separated feature list, e.g. -f inline
+            str = strdup(argv[i + 1]);
+            for (char *tok = strtok(str, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (strcmp(tok, "inline") == 0) flags |= WFS_F_INLINE;
+                else if (strcmp(tok, "compact") == 0) flags |= WFS_F_COMPACT;
+                else if (strcmp(tok, "checksum") == 0) flags |= WFS_F_CHECKSUM;
+                else if (strcmp(tok, "dedup") == 0) flags |= WFS_F_DEDUP;
+                else {
+                    free(str);
+                    freev((void*)disks, ndisks, 1);
+                    return 1;
+                }
+            }
+            free(str);
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            // create missing images and sparsely extend short ones to this size
+            if ((imagesize = parse_size(argv[i + 1])) <= 0) {
+                freev((void*)disks, ndisks, 1);
+                return 1;
+            }
+        }
         else if (strcmp(argv[i], "-b") == 0) {
-            str = argv[i + 1];
-            blocks = strtol(str, &endptr, 10);
-            if (errno != 0 || endptr == str || *endptr != '\0' || blocks <= 0) {
+            if ((nblocks = parse_list(argv[i + 1], disk_blocks, MAX_DISKS)) <= 0) {
+                freev((void*)disks, ndisks, 1);
+                return 1;
+            }
+            blocks = disk_blocks[0];
+        }
+        else if (strcmp(argv[i], "-w") == 0) {
+            // stripe weights, or measure them once the disks are formatted
+            if (strcmp(argv[i + 1], "bench") == 0) {
+                bench = 1;
+            }
+            else if ((nweights = parse_list(argv[i + 1], weights, MAX_DISKS)) <= 0) {
                 freev((void*)disks, ndisks, 1);
                 return 1;
             }
@@ -86,118 +398,164 @@ int main(int argc, char *argv[]) {
         i += 1;
     }
 
-    if (inodes <= 0 || blocks <= 0 || dcnt < 2) {
+    if (inodes <= 0 || blocks <= 0 || dcnt < 2 || dcnt > MAX_DISKS || (int)raid == -1) {
+        freev((void*)disks, ndisks, 1);
+        return 1;
+    }
+    // sizes and weights per disk only make sense for striping
+    if ((nblocks > 1 && (nblocks != dcnt || raid != RAID_0)) ||
+        ((nweights > 0 || bench) && ((nweights > 0 && nweights != dcnt) || raid != RAID_0))) {
         freev((void*)disks, ndisks, 1);
         return 1;
     }
 
-    // round up inodes and blocks to multiple of 32
+    // round up inodes and blocks to multiple of 32; blocks is the largest disk
     inodes = roundup(inodes, 32);
-    blocks = roundup(blocks, 32);
+    blocks = 0;
+    for (i = 0; i < dcnt; i++) {
+        disk_blocks[i] = roundup(disk_blocks[nblocks > 1 ? i : 0], 32);
+        blocks = disk_blocks[i] > blocks ? disk_blocks[i] : blocks;
+    }
+    // the metadata tier needs dentry blocks; a directory takes at least one
+    meta_blocks = mcnt == 0 ? 0 : roundup(meta_blocks > 0 ? meta_blocks : inodes, 32);
+    // by default blocks are striped in proportion to capacity
+    if (nweights == 0) {
+        long g = 0;
+        for (i = 0; i < dcnt; i++) {
+            g = gcd(disk_blocks[i], g);
+        }
+        for (i = 0; i < dcnt; i++) {
+            weights[i] = disk_blocks[i] / g;
+        }
+    }
 
-    int inodesize, dblocksize;
-    ssize_t req_totalsize;
-    char id[DISK_ID_SIZE];
-    char disk_ids[MAX_DISKS][DISK_ID_SIZE];
+    struct layout layout = { .imagesize = imagesize };
+    struct format_job jobs[MAX_DISKS + MAX_META];
+    char disk_ids[MAX_DISKS + MAX_META][DISK_ID_SIZE];
+    long islotsize, itablesize;
+    struct timespec start, end;
+    int status = 0;
 
-    for (i = 0; i < dcnt; i++) {
-        generate_id(i+1, id, sizeof(id));
-        strcpy(disk_ids[i], id);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < dcnt + mcnt; i++) {
+        generate_id(i+1, disk_ids[i], sizeof(disk_ids[i]));
     }
 
-    for (i = 0; i < dcnt; i++) {
-        FILE *disk = fopen(disks[i], "r+b");
-        if (disk == NULL) {
-            freev((void*)disks, ndisks, 1);
-            return -1;
-        }
+    // init inode bitmap & set root inode
+    layout.inodesize = roundup(inodes, 8) / 8;
+    layout.inodebitmap = calloc(1, layout.inodesize);
+    layout.inodebitmap[0 / 8] |= (1 << (0 % 8));
 
-        // init inode bitmap & set root inode
-        inodesize = roundup(inodes, 8) / 8;
-        unsigned char inodebitmap[inodesize];
-        memset(inodebitmap, 0, inodesize);
-        inodebitmap[0 / 8] |= (1 << (0 % 8));
-
-        // init data bitmap
-        dblocksize = roundup(blocks, 8) / 8;
-        unsigned char dbitmap[dblocksize];
-        memset(dbitmap, 0, dblocksize);
-
-        // init root inode
-        time_t ctime;
-        ctime = time(NULL);
-        struct wfs_inode root = {
-            .num = 0,
-            .mode = S_IFDIR | 755,
-            .uid = getuid(),
-            .gid = getgid(),
-            .size = 0,
-            .nlinks = 1,
-            .atim = ctime,
-            .mtim = ctime,
-            .ctim = ctime,
-        };
-        memset(root.blocks, -1, N_BLOCKS*(sizeof(off_t)));
-
-        // init superblock
-        struct wfs_sb superblock = {
-            .num_inodes = inodes,
-            .num_data_blocks = blocks,
-            .i_bitmap_ptr = sizeof(struct wfs_sb),
-            .d_bitmap_ptr = superblock.i_bitmap_ptr + sizeof(inodebitmap),
-            .i_blocks_ptr = roundup(superblock.d_bitmap_ptr + sizeof(dblocksize), BLOCK_SIZE),
-            .d_blocks_ptr = superblock.i_blocks_ptr + inodes*BLOCK_SIZE,
-            .raid = raid,
-            .num_disks = dcnt
-        };
-        strcpy(superblock.id, disk_ids[i]);
-        for (int j = 0; j < dcnt; j++) {
-            strcpy(superblock.disks[j], disk_ids[j]);
-        }
-
-        req_totalsize = sizeof(struct wfs_sb) + sizeof(inodebitmap) + sizeof(dbitmap) + inodes*BLOCK_SIZE + blocks*BLOCK_SIZE;
-        fseek(disk, 0, SEEK_END);
-        if (ftell(disk) < req_totalsize) {
-            fclose(disk);
-            freev((void*)disks, ndisks, 1);
-            return -1;
-        }
-        fseek(disk, 0, SEEK_SET);
+    // init data bitmap, which on metadata images tracks dentry blocks
+    layout.dblocksize = roundup(blocks > meta_blocks ? blocks : meta_blocks, 8) / 8;
+    layout.dbitmap = calloc(1, layout.dblocksize);
 
-        // superblock
-        if (fwrite(&superblock, sizeof(struct wfs_sb), 1, disk) != 1) {
-            fclose(disk);
-            freev((void*)disks, ndisks, 1);
-            return -1;
-        }
+    // packed inode tables drop the per-inode block padding
+    islotsize = (flags & WFS_F_COMPACT) ? sizeof(struct wfs_inode) : BLOCK_SIZE;
+    itablesize = roundup(inodes * islotsize, BLOCK_SIZE);
+    layout.itablesize = itablesize;
 
-        // inode bitmap
-        fseek(disk, superblock.i_bitmap_ptr, SEEK_SET);
-        if (fwrite(&inodebitmap, sizeof(inodebitmap), 1, disk) != 1) {
-            fclose(disk);
-            freev((void*)disks, ndisks, 1);
-            return -1;
-        }
+    // init root inode
+    time_t ctime;
+    ctime = time(NULL);
+    struct wfs_inode root = {
+        .num = 0,
+        .mode = S_IFDIR | 755,
+        .uid = getuid(),
+        .gid = getgid(),
+        .size = 0,
+        .nlinks = 1,
+        .atim = ctime,
+        .mtim = ctime,
+        .ctim = ctime,
+    };
+    memset(root.blocks, -1, N_BLOCKS*(sizeof(off_t)));
+    layout.rootslot = calloc(1, BLOCK_SIZE);
+    memcpy(layout.rootslot, &root, sizeof(struct wfs_inode));
 
-        // data bitmap
-        fseek(disk, superblock.d_bitmap_ptr, SEEK_SET);
-        if (fwrite(&dbitmap, sizeof(dbitmap), 1, disk) != 1) {
-            fclose(disk);
-            freev((void*)disks, ndisks, 1);
-            return -1;
+    // init superblock
+    struct wfs_sb superblock = {
+        .num_inodes = inodes,
+        .num_data_blocks = blocks,
+        .i_bitmap_ptr = sizeof(struct wfs_sb),
+        .d_bitmap_ptr = superblock.i_bitmap_ptr + layout.inodesize,
+        .i_blocks_ptr = roundup(superblock.d_bitmap_ptr + layout.dblocksize, BLOCK_SIZE),
+        .d_blocks_ptr = superblock.i_blocks_ptr + itablesize,
+        .raid = raid,
+        .num_disks = dcnt,
+        .flags = flags,
+        .num_meta = mcnt,
+        .meta_blocks = meta_blocks,
+    };
+    // free space counters: everything but the root inode
+    superblock.free_inodes = inodes - 1;
+    superblock.free_blocks = 0;
+    for (int j = 0; j < dcnt; j++) {
+        strcpy(superblock.disks[j], disk_ids[j]);
+        superblock.disk_blocks[j] = disk_blocks[j];
+        superblock.disk_free_blocks[j] = disk_blocks[j];
+        superblock.disk_weights[j] = weights[j];
+        if (raid == RAID_0 || j == 0) {
+            superblock.free_blocks += disk_blocks[j];
         }
+    }
+    for (int j = 0; j < mcnt; j++) {
+        strcpy(superblock.metas[j], disk_ids[dcnt + j]);
+    }
+    layout.sb = superblock;
 
-        // root inode
-        fseek(disk, superblock.i_blocks_ptr, SEEK_SET);
-        if (fwrite(&root, BLOCK_SIZE, 1, disk) != 1) {
-            fclose(disk);
-            freev((void*)disks, ndisks, 1);
-            return -1;
+    // format all disks in parallel, one thread each; metadata images come last
+    for (i = 0; i < dcnt + mcnt; i++) {
+        if (i < dcnt) {
+            jobs[i] = (struct format_job) {
+                .path = disks[i], .id = disk_ids[i], .blocks = disk_blocks[i], .itable = mcnt == 0, .layout = &layout, .status = -1
+            };
+        }
+        else {
+            jobs[i] = (struct format_job) {
+                .path = metas[i - dcnt], .id = disk_ids[i], .blocks = meta_blocks, .itable = 1, .layout = &layout, .status = -1
+            };
+        }
+        if (pthread_create(&jobs[i].thread, NULL, format_disk, &jobs[i]) != 0) {
+            format_disk(&jobs[i]);
+            jobs[i].thread = 0;
+        }
+    }
+    for (i = 0; i < dcnt + mcnt; i++) {
+        if (jobs[i].thread != 0) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+        if (jobs[i].status != 0) {
+            status = -1;
         }
+    }
 
-        fclose(disk);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (status == 0) {
+        long least = jobs[0].totalsize, most = jobs[0].totalsize;
+        for (i = 1; i < dcnt; i++) {
+            least = jobs[i].totalsize < least ? jobs[i].totalsize : least;
+            most = jobs[i].totalsize > most ? jobs[i].totalsize : most;
+        }
+        if (least == most) {
+            printf("formatted %d disks (%ld bytes each) in %.3f s\n", dcnt, most,
+                   (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        }
+        else {
+            printf("formatted %d disks (%ld to %ld bytes) in %.3f s\n", dcnt, least, most,
+                   (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        }
+        if (mcnt > 0) {
+            printf("formatted %d metadata images (%ld bytes each, %ld dentry blocks)\n", mcnt, jobs[dcnt].totalsize, meta_blocks);
+        }
+    }
+    if (status == 0 && bench) {
+        status = calibrate_weights(jobs, dcnt, mcnt, &superblock);
     }
 
+    free(layout.inodebitmap);
+    free(layout.dbitmap);
+    free(layout.rootslot);
     freev((void*)disks, ndisks, 1);
-    return 0;
+    return status;
 }
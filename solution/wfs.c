@@ -1,28 +1,58 @@
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 30
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include "wfs.h"
 
-void **disk_ptrs;
+void **disk_ptrs;           // the data disks, then any metadata images
 void *maindisk;
 size_t *disk_sizes;
 int total_disks;
+int meta_disks;
 DiskMode raid;
 int dentries = BLOCK_SIZE / sizeof(struct wfs_dentry);
 
+// serializes filesystem operations with the background scrubber
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FS_LOCK() pthread_mutex_t *fs_guard __attribute__((cleanup(unlock_fs))) = lock_fs()
+#define SCRUB_PATH "/.scrub"
+#define RESTRIPE_PATH "/.restripe"
+#define WFS_MAX_WRITE (128 * 1024)
+
 void freev(void **ptr, int len, int free_seg) {
     if (len < 0) while (*ptr) { free(*ptr); *ptr++ = NULL; }
     else { for (int i = 0; i < len; i++) free(ptr[i]); }
     if (free_seg) free(ptr);
 }
 
+pthread_mutex_t* lock_fs() {
+    pthread_mutex_lock(&fs_lock);
+    return &fs_lock;
+}
+
+void unlock_fs(pthread_mutex_t **lock) {
+    pthread_mutex_unlock(*lock);
+}
+
 int roundup(int n, int k) {
     int r = n % k;
     if (r == 0) return n;
@@ -45,28 +75,437 @@ void* mapdisk(int dd) {
     return map_ptr;
 }
 
+/*
+  Mapping manager. Each image stays reserved in one shared mapping, so
+  pointers into it remain valid, but residency is managed per region.
+  The superblock, bitmaps, inode table and checksums are advised
+  MADV_WILLNEED and never dropped. The data region gets --data-advice
+  (random by default) and is tracked in MAP_WINDOW sized windows: every
+  access to a data disk (fetch_block, mirroring, mirror fallbacks, the
+  scrubber and restriping) touches the windows it uses, and with
+  --mem-budget only that many bytes of windows stay resident. Windows are
+  found through a hash on (disk, index) and kept on an LRU list; the least
+  recently used one is dropped with MADV_DONTNEED, which for a shared
+  file mapping only unmaps the pages; the data stays in the image.
+*/
+#define MAP_WINDOW (1L << 20)
+
+struct map_window {
+    int disk;
+    long index;
+    long prev, next;    // LRU list, most recent first
+    long hnext;         // next window in the same hash bucket
+};
+
+struct map_state {
+    long budget;
+    int advice;
+    struct map_window *windows;
+    long nwindows;
+    long nused;         // slots handed out so far
+    long head, tail;
+    long *buckets;      // first window of each (disk, index) hash chain
+    long nbuckets;
+} maps = { .advice = MADV_RANDOM, .head = -1, .tail = -1 };
+
+// parse a size with an optional K, M or G suffix
+long parse_size(const char *str) {
+    char *endptr;
+    long size;
+
+    errno = 0;
+    size = strtol(str, &endptr, 10);
+    if (errno != 0 || endptr == str || size <= 0) return -1;
+    switch (*endptr) {
+        case 'G': size *= 1024;   /* fall through */
+        case 'M': size *= 1024;   /* fall through */
+        case 'K': size *= 1024; endptr++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*endptr != '\0') return -1;
+    return size;
+}
+
+// page aligned [start, end) of the data region of a disk
+void map_data_bounds(int disk, off_t *start, off_t *end) {
+    struct wfs_sb sb;
+    long page = sysconf(_SC_PAGESIZE);
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    *start = (sb.d_blocks_ptr + page - 1) & ~(page - 1);
+    *end = (sb.d_blocks_ptr + (off_t)sb.disk_blocks[disk] * BLOCK_SIZE) & ~(page - 1);
+}
+
+// apply the per-region policies and set up the window table
+void map_init() {
+    struct wfs_sb sb;
+    off_t data_start, data_end;
+    long page = sysconf(_SC_PAGESIZE);
+
+    for (int i = 0; i < total_disks; i++) {
+        // disks of different sizes keep their checksums in different places
+        memcpy(&sb, disk_ptrs[i], sizeof(struct wfs_sb));
+        map_data_bounds(i, &data_start, &data_end);
+        madvise(disk_ptrs[i], data_start, MADV_WILLNEED);
+        if (data_end > data_start) {
+            madvise((char*)disk_ptrs[i] + data_start, data_end - data_start, maps.advice);
+        }
+        if (sb.c_blocks_ptr != 0) {
+            off_t c_start = sb.c_blocks_ptr & ~(page - 1);
+            madvise((char*)disk_ptrs[i] + c_start, disk_sizes[i] - c_start, MADV_WILLNEED);
+        }
+    }
+    // a metadata image holds nothing else
+    for (int i = total_disks; i < total_disks + meta_disks; i++) {
+        madvise(disk_ptrs[i], disk_sizes[i], MADV_WILLNEED);
+    }
+    if (maps.budget > 0) {
+        maps.nwindows = maps.budget / MAP_WINDOW > 0 ? maps.budget / MAP_WINDOW : 1;
+        maps.windows = calloc(maps.nwindows, sizeof(struct map_window));
+        for (maps.nbuckets = 1; maps.nbuckets < 2 * maps.nwindows; maps.nbuckets *= 2);
+        maps.buckets = malloc(maps.nbuckets * sizeof(long));
+        for (long i = 0; i < maps.nbuckets; i++) {
+            maps.buckets[i] = -1;
+        }
+    }
+}
+
+void map_evict(struct map_window *w) {
+    off_t data_start, data_end, start, end;
+
+    map_data_bounds(w->disk, &data_start, &data_end);
+    start = w->index * MAP_WINDOW > data_start ? w->index * MAP_WINDOW : data_start;
+    end = (w->index + 1) * MAP_WINDOW < data_end ? (w->index + 1) * MAP_WINDOW : data_end;
+    if (end > start) {
+        madvise((char*)disk_ptrs[w->disk] + start, end - start, MADV_DONTNEED);
+    }
+}
+
+long map_hash(int disk, long index) {
+    return ((unsigned long)index * 31 + disk) & (maps.nbuckets - 1);
+}
+
+void map_unlink(long i) {
+    struct map_window *w = &maps.windows[i];
+
+    if (w->prev != -1) maps.windows[w->prev].next = w->next;
+    else maps.head = w->next;
+    if (w->next != -1) maps.windows[w->next].prev = w->prev;
+    else maps.tail = w->prev;
+}
+
+void map_unhash(long i) {
+    long *link = &maps.buckets[map_hash(maps.windows[i].disk, maps.windows[i].index)];
+
+    while (*link != i) {
+        link = &maps.windows[*link].hnext;
+    }
+    *link = maps.windows[i].hnext;
+}
+
+// note a use of offset off on a disk, evicting the oldest window if over budget
+void map_touch(int disk, off_t off) {
+    long index = off / MAP_WINDOW;
+    long h, i;
+    struct map_window *w;
+
+    // metadata images stay resident and have no windows
+    if (maps.windows == NULL || disk >= total_disks) {
+        return;
+    }
+    h = map_hash(disk, index);
+    for (i = maps.buckets[h]; i != -1; i = maps.windows[i].hnext) {
+        if (maps.windows[i].disk == disk && maps.windows[i].index == index) {
+            break;
+        }
+    }
+    if (i == maps.head && i != -1) {
+        return;
+    }
+    if (i != -1) {
+        map_unlink(i);
+    }
+    else {
+        if (maps.nused < maps.nwindows) {
+            i = maps.nused++;
+        }
+        else {
+            i = maps.tail;
+            map_evict(&maps.windows[i]);
+            map_unlink(i);
+            map_unhash(i);
+        }
+        w = &maps.windows[i];
+        w->disk = disk;
+        w->index = index;
+        w->hnext = maps.buckets[h];
+        maps.buckets[h] = i;
+    }
+    w = &maps.windows[i];
+    w->prev = -1;
+    w->next = maps.head;
+    if (maps.head != -1) maps.windows[maps.head].prev = i;
+    else maps.tail = i;
+    maps.head = i;
+}
+
+// map_touch every window of [off, off + len) on a disk
+void map_touch_range(int disk, off_t off, size_t len) {
+    for (off_t w = off - off % MAP_WINDOW; w < off + (off_t)len; w += MAP_WINDOW) {
+        map_touch(disk, w);
+    }
+}
+
+/*
+  Metadata tier. With mkfs -m the superblock of record, the inode bitmap,
+  the inode table and every dentry block live on their own images, so
+  mknod, getattr and readdir never touch the data disks. The images sit
+  in disk_ptrs after the total_disks data disks, maindisk is the first of
+  them, and they mirror each other whatever the RAID mode of the data.
+  Dentry blocks are numbered from META_BASE (see wfs.h).
+*/
+int ismeta(struct wfs_sb sb) {
+    for (int j = 0; j < sb.num_meta; j++) {
+        if (strcmp(sb.id, sb.metas[j]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// first disk of the mirror set disk belongs to; *n gets the set's size
+int mirror_set(int disk, int *n) {
+    if (disk >= total_disks) {
+        *n = meta_disks;
+        return total_disks;
+    }
+    *n = total_disks;
+    return 0;
+}
+
 int validatedisk(struct wfs_sb sb) {
     for (int j = 0; j < sb.num_disks; j++) {
         if (strcmp(sb.id, sb.disks[j]) == 0) {
             return 1;
         }
     }
-    return 0;
+    return ismeta(sb);
+}
+
+/*
+  Block numbers. RAID0 stripes dnum over the disks: disk dnum % n, offset
+  dnum / n. Adding a disk changes n, so the restriper (see below) moves
+  blocks to their new place in dnum order. Block numbers below
+  restripe.pos have moved and use all total_disks; the rest still use
+  restripe.from disks. Inodes keep their block numbers throughout.
+*/
+struct restripe_state {
+    pthread_t thread;
+    int running;
+    int stop;
+    int paused;
+    long rate;
+    int from;       // disks before the added one, 0 when not restriping
+    long pos;       // first block number still in the old layout
+    long end;       // block numbers of the old layout end here
+    long moved;
+} restripe = { .rate = 4096 };
+
+// disks the stripe of dnum spans
+int stripe_width(int dnum) {
+    return restripe.from != 0 && dnum >= restripe.pos ? restripe.from : total_disks;
+}
+
+// offsets of a disk that hold no block number mid restripe: [lo, hi)
+void restripe_gap(int disk, long *lo, long *hi) {
+    long pos = restripe.pos;
+
+    *lo = *hi = 0;
+    if (restripe.from == 0) {
+        return;
+    }
+    // offsets below lo have moved in, those from hi on have not moved out
+    *lo = pos > disk ? (pos - disk + total_disks - 1) / total_disks : 0;
+    if (disk >= restripe.from) {
+        *hi = LONG_MAX;
+    }
+    else {
+        *hi = pos > disk ? (pos - disk + restripe.from - 1) / restripe.from : 0;
+    }
 }
 
+// block number of an offset on a disk, -1 if it has none right now
 int raid0_idx(int disk, int offset) {
-    return (offset * total_disks + disk);
+    long lo, hi;
+
+    restripe_gap(disk, &lo, &hi);
+    if (offset >= lo && offset < hi) {
+        return -1;
+    }
+    if (restripe.from != 0 && offset >= hi) {
+        return offset * restripe.from + disk;
+    }
+    return offset * total_disks + disk;
 }
 
 int raid0_disk(int dnum) {
     if (raid != RAID_0) {
         return 0;
     }
-    return dnum % total_disks;
+    return dnum % stripe_width(dnum);
 }
 
 int raid0_offset(int dnum) {
-    return dnum / total_disks;
+    return dnum / stripe_width(dnum);
+}
+
+uint32_t crc32c_table[256];
+uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *buf, size_t len);
+
+uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len--) {
+        crc = crc32c_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t c = crc;
+    uint64_t v;
+
+    while (len >= sizeof(uint64_t)) {
+        memcpy(&v, buf, sizeof(uint64_t));
+        c = _mm_crc32_u64(c, v);
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    while (len--) {
+        c = _mm_crc32_u8((uint32_t)c, *buf++);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// pick the SSE4.2 crc32 instruction when the cpu has it
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+    crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len) {
+    return ~crc32c_update(~0U, buf, len);
+}
+
+// index of the disk whose mapping contains ptr
+int owning_disk(off_t ptr) {
+    for (int i = 0; i < total_disks + meta_disks; i++) {
+        if (ptr >= (off_t)disk_ptrs[i] && ptr < (off_t)disk_ptrs[i] + (off_t)disk_sizes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// checksum slot of the inode table or data block at offset off of disk_ptr
+uint32_t* checksum_ptr(void *disk_ptr, off_t off) {
+    struct wfs_sb sb;
+    off_t idx;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if ((sb.flags & WFS_F_CHECKSUM) == 0 || off < sb.i_blocks_ptr || off >= sb.c_blocks_ptr) {
+        return 0;
+    }
+    // INODES and DATA BLOCKS are contiguous, so one index covers both
+    idx = (off - sb.i_blocks_ptr) / BLOCK_SIZE;
+    return (uint32_t*)((off_t)disk_ptr + sb.c_blocks_ptr + idx * sizeof(uint32_t));
+}
+
+void update_checksums(off_t dst, size_t size) {
+    int disk = owning_disk(dst);
+    uint32_t *csum;
+    off_t off, end;
+
+    if (disk == -1 || size == 0) {
+        return;
+    }
+    off = dst - (off_t)disk_ptrs[disk];
+    end = off + size;
+    for (off -= off % BLOCK_SIZE; off < end; off += BLOCK_SIZE) {
+        if ((csum = checksum_ptr(disk_ptrs[disk], off)) != 0) {
+            *csum = crc32c((void*)((off_t)disk_ptrs[disk] + off), BLOCK_SIZE);
+        }
+    }
+}
+
+// 1 if every block of [off, off + size) on disk_ptr matches its checksum
+int blocks_valid(void *disk_ptr, off_t off, size_t size) {
+    uint32_t *csum;
+    off_t end = off + size;
+
+    for (off -= off % BLOCK_SIZE; off < end; off += BLOCK_SIZE) {
+        csum = checksum_ptr(disk_ptr, off);
+        if (csum != 0 && *csum != 0 && *csum != crc32c((void*)((off_t)disk_ptr + off), BLOCK_SIZE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+  Returns a readable address for [ptr, ptr + size) whose blocks pass their
+  checksums. On a mismatch mirrored copies (everything in RAID1, the inode
+  table in RAID0) fall back to the same offset on another disk and copy the
+  good blocks over the bad ones. Returns 0 if no copy verifies.
+*/
+off_t verified_ptr(off_t ptr, size_t size) {
+    int disk = owning_disk(ptr);
+    struct wfs_sb sb;
+    off_t off, start, len;
+    int first, n;
+
+    if (disk == -1) {
+        return ptr;
+    }
+    off = ptr - (off_t)disk_ptrs[disk];
+    if (blocks_valid(disk_ptrs[disk], off, size)) {
+        return ptr;
+    }
+    fprintf(stderr, "wfs: checksum mismatch on disk %d at offset %ld\n", disk, off);
+    memcpy(&sb, disk_ptrs[disk], sizeof(struct wfs_sb));
+    if (raid == RAID_0 && disk < total_disks && off >= sb.d_blocks_ptr) {
+        return 0;
+    }
+    first = mirror_set(disk, &n);
+    for (int i = first; i < first + n; i++) {
+        if (i == disk) {
+            continue;
+        }
+        map_touch_range(i, off, size);
+        if (!blocks_valid(disk_ptrs[i], off, size)) {
+            continue;
+        }
+        start = off - (off % BLOCK_SIZE);
+        len = roundup(off + size - start, BLOCK_SIZE);
+        memcpy((void*)((off_t)disk_ptrs[disk] + start), (void*)((off_t)disk_ptrs[i] + start), len);
+        update_checksums((off_t)disk_ptrs[disk] + start, len);
+        fprintf(stderr, "wfs: repaired disk %d at offset %ld from mirror %d\n", disk, off, i);
+        return (off_t)disk_ptrs[i] + off;
+    }
+    return 0;
 }
 
 /*int mirror_data(void *maindisk, void *src, size_t size) {*/
@@ -76,61 +515,249 @@ int raid0_offset(int dnum) {
 /*    return 1;*/
 /*}*/
 
-void mirror_data_raid1() {
-    for (int i = 1; i < total_disks; i++) {
-        memcpy(disk_ptrs[i], maindisk, disk_sizes[0]);
-    }
-}
+// copy [dst, dst + size) of the first disk of a mirror set to the same offset on the rest
+void mirror_range(off_t dst, size_t size) {
+    int n, first = mirror_set(owning_disk(dst), &n);
+    off_t off = dst - (off_t)disk_ptrs[first];
 
-void mirror_data_raid0(off_t dst, size_t size) {
-    for (int i = 1; i < total_disks; i++) {
-        memcpy((void*)((off_t)disk_ptrs[i] + (dst - (off_t)maindisk)), (void*)dst, size);
+    map_touch_range(first, off, size);
+    for (int i = first + 1; i < first + n; i++) {
+        map_touch_range(i, off, size);
+        memcpy((void*)((off_t)disk_ptrs[i] + off), (void*)dst, size);
+        update_checksums((off_t)disk_ptrs[i] + off, size);
     }
 }
 
 void memcpy_v(off_t dst, void *src, size_t size, int metadata) {
     memcpy((void*)dst, src, size);
+    update_checksums(dst, size);
     switch(raid) {
         case RAID_0:
-            if (metadata == 1) {
-                mirror_data_raid0(dst, size);
+            // dentry blocks on a metadata tier are mirrored as well
+            if (metadata == 1 || (meta_disks > 0 && owning_disk(dst) >= total_disks)) {
+                mirror_range(dst, size);
             }
             break;
         default:
-            mirror_data_raid1();
+            mirror_range(dst, size);
             break;
     }
 }
 
-struct wfs_inode fetch_inode(int inum) {
-    printf("[DEBUG] inside fetch_inode\n");
+// bytes per inode table record: a full block, or just the inode when packed
+size_t inode_slot_size(struct wfs_sb sb) {
+    if (sb.flags & WFS_F_COMPACT) {
+        return sizeof(struct wfs_inode);
+    }
+    return BLOCK_SIZE;
+}
+
+off_t inode_ptr(int inum) {
     void *disk_ptr = maindisk;
     struct wfs_sb sb;
-    struct wfs_inode inode;
-    off_t i_blocks_ptr;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
-    memcpy(&inode, (void*)(i_blocks_ptr + (inum * BLOCK_SIZE)), sizeof(struct wfs_inode));
-    inode.atim = time(NULL);
-    memcpy_v((i_blocks_ptr + (inum * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
+    return (off_t)disk_ptr + sb.i_blocks_ptr + (inum * inode_slot_size(sb));
+}
+
+struct wfs_inode fetch_inode(int inum) {
+    printf("[DEBUG] inside fetch_inode\n");
+    struct wfs_inode inode;
+    off_t i_ptr;
+
+    if ((i_ptr = verified_ptr(inode_ptr(inum), sizeof(struct wfs_inode))) == 0) {
+        fprintf(stderr, "wfs: no valid copy of inode %d\n", inum);
+        i_ptr = inode_ptr(inum);
+    }
+    memcpy(&inode, (void*)i_ptr, sizeof(struct wfs_inode));
+    if (!(inode.mode & WFS_S_SNAPSHOT)) {
+        inode.atim = time(NULL);
+        memcpy_v(inode_ptr(inum), &inode, sizeof(struct wfs_inode), 1);
+    }
     printf("[DEBUG] successfully fetched inode %d\n", inode.num);
     return inode;
 }
 
+// bytes of file data that fit in the inode slot after the inode itself
+size_t inline_capacity(struct wfs_sb sb) {
+    if ((sb.flags & WFS_F_INLINE) == 0) {
+        return 0;
+    }
+    return inode_slot_size(sb) - sizeof(struct wfs_inode);
+}
+
+// small regular files keep their data in the inode slot until they outgrow it
+int isinline(struct wfs_inode inode, struct wfs_sb sb) {
+    return S_ISREG(inode.mode) && inline_capacity(sb) > 0 &&
+           inode.size <= inline_capacity(sb) && inode.blocks[0] == -1;
+}
+
+/*
+  Transparent compression (--compress). A compressed file keeps its whole
+  contents as one stream, so every write recompresses the file; with at
+  most N_BLOCKS blocks per file that is cheaper than the extra mirrored
+  blocks it saves. The codec is a small LZ4-style block format: a token
+  with 4-bit literal and match lengths, the literals, a 16-bit match
+  offset, and 255-continued extra length bytes.
+*/
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 10
+#define ZCACHE_SLOTS 16
+
+int compress;
+
+// recently used compressed files, decompressed; an entry with used == 0 is empty
+struct zcache_entry {
+    int inum;
+    long used;
+    off_t size;
+    unsigned char data[N_BLOCKS * BLOCK_SIZE];
+};
+struct zcache_entry zcache[ZCACHE_SLOTS];
+long zcache_tick;
+
+// append an extra length run; returns the new position or -1 if out of room
+int lz_put_len(unsigned char *dst, int pos, int cap, int len) {
+    while (len >= 255) {
+        if (pos >= cap) return -1;
+        dst[pos++] = 255;
+        len -= 255;
+    }
+    if (pos >= cap) return -1;
+    dst[pos++] = len;
+    return pos;
+}
+
+// returns the compressed length, or -1 if it does not fit in cap bytes
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int table[1 << LZ_HASHBITS];
+    int anchor = 0, pos = 0, i = 0;
+    int lit, ref, mlen, h;
+    uint32_t seq;
+
+    memset(table, -1, sizeof(table));
+    // the last bytes of the input are always literals
+    while (i + LZ_MINMATCH + 8 <= n) {
+        memcpy(&seq, src + i, sizeof(seq));
+        h = (seq * 2654435761u) >> (32 - LZ_HASHBITS);
+        ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > 65535 || memcmp(src + ref, src + i, LZ_MINMATCH) != 0) {
+            i++;
+            continue;
+        }
+        mlen = LZ_MINMATCH;
+        while (i + mlen < n - 5 && src[ref + mlen] == src[i + mlen]) {
+            mlen++;
+        }
+
+        lit = i - anchor;
+        if (pos >= cap) return -1;
+        dst[pos++] = (min(lit, 15) << 4) | min(mlen - LZ_MINMATCH, 15);
+        if (lit >= 15 && (pos = lz_put_len(dst, pos, cap, lit - 15)) < 0) return -1;
+        if (pos + lit + 2 > cap) return -1;
+        memcpy(dst + pos, src + anchor, lit);
+        pos += lit;
+        dst[pos++] = (i - ref) & 0xff;
+        dst[pos++] = (i - ref) >> 8;
+        if (mlen - LZ_MINMATCH >= 15 && (pos = lz_put_len(dst, pos, cap, mlen - LZ_MINMATCH - 15)) < 0) return -1;
+        i += mlen;
+        anchor = i;
+    }
+
+    lit = n - anchor;
+    if (pos >= cap) return -1;
+    dst[pos++] = min(lit, 15) << 4;
+    if (lit >= 15 && (pos = lz_put_len(dst, pos, cap, lit - 15)) < 0) return -1;
+    if (pos + lit > cap) return -1;
+    memcpy(dst + pos, src + anchor, lit);
+    return pos + lit;
+}
+
+// returns the decompressed length, or -1 if the stream is malformed
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int ip = 0, op = 0;
+    int token, lit, mlen, moff, b;
+
+    while (ip < n) {
+        token = src[ip++];
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (ip + lit > n || op + lit > cap) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        // the final sequence has literals only
+        if (ip == n) break;
+
+        if (ip + 2 > n) return -1;
+        moff = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        mlen = (token & 15) + LZ_MINMATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        if (moff == 0 || moff > op || op + mlen > cap) return -1;
+        // byte by byte, matches may overlap their own output
+        for (int k = 0; k < mlen; k++, op++) {
+            dst[op] = dst[op - moff];
+        }
+    }
+    return op;
+}
+
+struct zcache_entry* zcache_lookup(int inum) {
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache[i].used != 0 && zcache[i].inum == inum) {
+            zcache[i].used = ++zcache_tick;
+            return &zcache[i];
+        }
+    }
+    return NULL;
+}
+
+// claim an entry for inum, evicting the least recently used one
+struct zcache_entry* zcache_insert(int inum) {
+    struct zcache_entry *victim = &zcache[0];
+
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache[i].used == 0 || zcache[i].inum == inum) {
+            victim = &zcache[i];
+            break;
+        }
+        if (zcache[i].used < victim->used) {
+            victim = &zcache[i];
+        }
+    }
+    victim->inum = inum;
+    victim->used = ++zcache_tick;
+    return victim;
+}
+
+void zcache_drop(int inum) {
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache[i].inum == inum) {
+            zcache[i].used = 0;
+        }
+    }
+}
+
+int dir_lookup(struct wfs_inode *inode, const char *name);
+
 int validatepath(const char* path) {
     printf("[DEBUG] inside validatepath\n");
-    void *disk_ptr = maindisk;
-    struct wfs_sb sb;
     struct wfs_inode inode;
-    struct wfs_dentry dentry;
-    off_t d_blocks_ptr;
     int inum;
-    int blk;
-    int dnum;
-    int found;
-
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
 
     char *delim = "/";
     char *path_cpy = strdup(path);
@@ -140,33 +767,14 @@ int validatepath(const char* path) {
     while (tok != NULL) {
         inode = fetch_inode(inum);
         inode.atim = time(NULL);
-        found = 0;
-        for (int i = 0; i < N_BLOCKS; i++) {
-            blk = inode.blocks[i];
-            if (blk == -1)
-                continue;
-
-            dnum = raid0_offset(blk);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(blk)] + sb.d_blocks_ptr;
-            off_t start = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            for (off_t ptr = start; ptr < start + BLOCK_SIZE; ptr += sizeof(struct wfs_dentry)) {
-                memcpy(&dentry, (void*)ptr, sizeof(struct wfs_dentry));
-                if (strcmp(dentry.name, tok) == 0 && dentry.num != -1) {
-                    inum = dentry.num;
-                    found = 1;
-                    break;
-                }
-            }
-            if (found) {
-                break;
-            }
-        }
-        if (!found) {
-            printf("[DEBUG] invalid path, inum: %d\n", inum);
+        if ((inum = dir_lookup(&inode, tok)) == -1) {
+            printf("[DEBUG] invalid path, inum: %d\n", inode.num);
+            free(path_cpy);
             return -1;
         }
         tok = strtok(NULL, delim);
     }
+    free(path_cpy);
     printf("[DEBUG] successfully validated path, inum: %d\n", inum);
     return inum;
 }
@@ -198,41 +806,6 @@ const char* getname(const char *path) {
     return name;
 }
 
-int isdirempty(int inum) {
-    printf("[DEBUG] inside isdirempty\n");
-    void *disk_ptr = maindisk;
-    struct wfs_sb sb;
-    struct wfs_inode inode;
-    struct wfs_dentry dentry;
-    off_t d_blocks_ptr;
-    int blk;
-    int dnum;
-    int i;
-
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    inode = fetch_inode(inum);
-
-    i = 0;
-    while (i < N_BLOCKS) {
-        blk = inode.blocks[i];
-        if (blk != -1) {
-            dnum = raid0_offset(blk);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(blk)] + sb.d_blocks_ptr;
-            off_t start = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            for (off_t ptr = start; ptr < start + BLOCK_SIZE; ptr += sizeof(struct wfs_dentry)) {
-                memcpy(&dentry, (void*)ptr, sizeof(struct wfs_dentry));
-                if (dentry.num != -1) {
-                    printf("[DEBUG] directory not empty\n");
-                    return 0;
-                }
-            }
-        }
-        i++;
-    }
-    printf("[DEBUG] directory is empty\n");
-    return 1;
-}
-
 
 off_t fetch_block(int dnum) {
     printf("[DEBUG] inside fetch_block\n");
@@ -243,109 +816,499 @@ off_t fetch_block(int dnum) {
     off_t d_blocks_ptr;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    // dentry blocks of the metadata tier stay resident and skip the windows
+    if (dnum >= META_BASE) {
+        return (off_t)maindisk + sb.d_blocks_ptr + (off_t)(dnum - META_BASE) * BLOCK_SIZE;
+    }
     parsed_dnum = raid0_offset(dnum);
     disk = raid0_disk(dnum);
     d_blocks_ptr = (off_t)disk_ptrs[disk] + sb.d_blocks_ptr;
     off_t block = d_blocks_ptr + (parsed_dnum * BLOCK_SIZE);
+    map_touch(disk, block - (off_t)disk_ptrs[disk]);
     return block;
 }
 
 struct wfs_dentry* fetch_empty_dentry(int dnum) {
-    void *disk_ptr = maindisk;
     printf("[DEBUG] inside fetch_empty_dentry\n");
-    int parsed_dnum;
-    int disk;
-    struct wfs_sb sb;
     struct wfs_dentry dentry;
-    off_t d_blocks_ptr;
 
-    parsed_dnum = raid0_offset(dnum);
-    disk = raid0_disk(dnum);
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    d_blocks_ptr = (off_t)disk_ptrs[disk] + sb.d_blocks_ptr;
-    off_t start = d_blocks_ptr + (parsed_dnum * BLOCK_SIZE);
+    off_t start = fetch_block(dnum);
     for (off_t ptr = start; ptr < start + BLOCK_SIZE; ptr += sizeof(struct wfs_dentry)) {
         memcpy(&dentry, (void*)ptr, sizeof(struct wfs_dentry));
         if (dentry.num == -1) {
-            printf("[DEBUG] found empty dentry in block %d\n", parsed_dnum);
+            printf("[DEBUG] found empty dentry in block %d\n", dnum);
             return (struct wfs_dentry*)ptr;
         }
     }
-    printf("[DEBUG] no empty dentry in block %d\n", parsed_dnum);
+    printf("[DEBUG] no empty dentry in block %d\n", dnum);
     return 0;
 }
 
-int data_exists(const char* name, int inum) {
-    printf("[DEBUG] inside data_exists\n");
-    void *disk_ptr = maindisk;
-    struct wfs_sb sb;
-    struct wfs_inode inode;
-    struct wfs_dentry dentry;
-    off_t d_blocks_ptr;
+/*
+  Large directories. A directory keeps its dentry blocks in blocks[] until
+  it needs more than N_BLOCKS of them; it then gets WFS_S_DIRTREE and
+  blocks[IND_BLOCK] roots a two level tree of dentry block numbers (see
+  wfs.h). Dentry blocks are addressed by slot: slots below IND_BLOCK are
+  blocks[], the rest are tree leaves, and slot IND_BLOCK is the same block
+  before and after the conversion. Dentry blocks are only released with
+  their directory, so the used slots always form a prefix.
+
+  Tree directories also get a name index, kept in memory only like the
+  dedup index. It is built on first use after mount, kept in step by
+  add_dentry and free_dentry, and remembers the first slot that may have
+  a free dentry so creates do not rescan full blocks. Entries name a
+  dentry by slot and position rather than by address, since a restripe
+  moves the blocks behind the slots.
+*/
+struct dir_name {
+    uint32_t hash;
+    long slot;
+    int d;              // dentry within the slot's block
+    struct dir_name *next;
+};
+
+struct dir_index {
+    int inum;
+    long hint;
+    long count;
+    long nbuckets;
+    struct dir_name **buckets;
+    struct dir_index *next;
+} *dir_indexes;
+
+long dir_slots(struct wfs_inode *inode) {
+    return (inode->mode & WFS_S_DIRTREE) ? IND_BLOCK + DIR_FANOUT * DIR_FANOUT : N_BLOCKS;
+}
+
+// dentry block in the first used slot at or after *n, or -1 if there is none
+int dir_next(struct wfs_inode *inode, long *n) {
+    int *index, *ptrs;
+    long k;
+
+    for (; *n < dir_slots(inode); (*n)++) {
+        if (*n < IND_BLOCK || !(inode->mode & WFS_S_DIRTREE)) {
+            if (inode->blocks[*n] != -1) {
+                return inode->blocks[*n];
+            }
+            continue;
+        }
+        k = *n - IND_BLOCK;
+        index = (int*)fetch_block(inode->blocks[IND_BLOCK]);
+        if (index[k / DIR_FANOUT] == -1) {
+            // skip the rest of a missing pointer block
+            *n += DIR_FANOUT - 1 - k % DIR_FANOUT;
+            continue;
+        }
+        ptrs = (int*)fetch_block(index[k / DIR_FANOUT]);
+        if (ptrs[k % DIR_FANOUT] != -1) {
+            return ptrs[k % DIR_FANOUT];
+        }
+    }
+    return -1;
+}
+
+// index and pointer blocks of a tree directory, stored in out; returns how many
+int dir_tree_blocks(struct wfs_inode *inode, int *out) {
+    int *index;
+    int n = 0;
+
+    if (!(inode->mode & WFS_S_DIRTREE)) {
+        return 0;
+    }
+    index = (int*)fetch_block(inode->blocks[IND_BLOCK]);
+    out[n++] = inode->blocks[IND_BLOCK];
+    for (long k = 0; k < DIR_FANOUT; k++) {
+        if (index[k] != -1) {
+            out[n++] = index[k];
+        }
+    }
+    return n;
+}
+
+// dentry d of the block in used slot n
+struct wfs_dentry* dir_dentry(struct wfs_inode *inode, long n, int d) {
+    return (struct wfs_dentry*)fetch_block(dir_next(inode, &n)) + d;
+}
+
+uint32_t dir_hash(const char *name) {
+    return crc32c(name, strnlen(name, MAX_NAME));
+}
+
+void dir_index_add(struct dir_index *idx, const char *name, long slot, int d) {
+    struct dir_name *entry, *moved;
+    struct dir_name **old;
+    long nold;
+
+    // keep chains short by doubling the table as the directory grows
+    if (idx->count >= 2 * idx->nbuckets) {
+        old = idx->buckets;
+        nold = idx->nbuckets;
+        idx->nbuckets *= 2;
+        idx->buckets = calloc(idx->nbuckets, sizeof(struct dir_name*));
+        for (long b = 0; b < nold; b++) {
+            while ((moved = old[b]) != NULL) {
+                old[b] = moved->next;
+                moved->next = idx->buckets[moved->hash & (idx->nbuckets - 1)];
+                idx->buckets[moved->hash & (idx->nbuckets - 1)] = moved;
+            }
+        }
+        free(old);
+    }
+    entry = malloc(sizeof(struct dir_name));
+    entry->hash = dir_hash(name);
+    entry->slot = slot;
+    entry->d = d;
+    entry->next = idx->buckets[entry->hash & (idx->nbuckets - 1)];
+    idx->buckets[entry->hash & (idx->nbuckets - 1)] = entry;
+    idx->count++;
+}
+
+// link to the first entry called name from *link on, or to the NULL ending the chain
+struct dir_name** dir_index_match(struct wfs_inode *inode, struct dir_name **link, uint32_t h, const char *name) {
+    for (; *link != NULL; link = &(*link)->next) {
+        if ((*link)->hash == h && strncmp(dir_dentry(inode, (*link)->slot, (*link)->d)->name, name, MAX_NAME) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+struct dir_name** dir_index_find(struct wfs_inode *inode, struct dir_index *idx, const char *name) {
+    uint32_t h = dir_hash(name);
+    return dir_index_match(inode, &idx->buckets[h & (idx->nbuckets - 1)], h, name);
+}
+
+void dir_index_unlink(struct dir_index *idx, struct dir_name **link) {
+    struct dir_name *entry = *link;
+
+    *link = entry->next;
+    free(entry);
+    idx->count--;
+}
+
+struct dir_index* dir_index_cached(int inum) {
+    for (struct dir_index *idx = dir_indexes; idx != NULL; idx = idx->next) {
+        if (idx->inum == inum) {
+            return idx;
+        }
+    }
+    return NULL;
+}
+
+// name index of a tree directory, built on first use; NULL for small directories
+struct dir_index* dir_index_get(struct wfs_inode *inode) {
+    struct dir_index *idx;
+    struct wfs_dentry *entries;
+    long end = 0;
     int blk;
-    int dnum;
-    int i;
 
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    inode = fetch_inode(inum);
+    if (!(inode->mode & WFS_S_DIRTREE)) {
+        return NULL;
+    }
+    if ((idx = dir_index_cached(inode->num)) != NULL) {
+        return idx;
+    }
+    idx = calloc(1, sizeof(struct dir_index));
+    idx->inum = inode->num;
+    idx->hint = -1;
+    idx->nbuckets = 64;
+    idx->buckets = calloc(idx->nbuckets, sizeof(struct dir_name*));
+    for (long n = 0; (blk = dir_next(inode, &n)) != -1; n++) {
+        entries = (struct wfs_dentry*)fetch_block(blk);
+        for (int d = 0; d < dentries; d++) {
+            if (entries[d].num != -1) {
+                dir_index_add(idx, entries[d].name, n, d);
+            }
+            else if (idx->hint == -1) {
+                idx->hint = n;
+            }
+        }
+        end = n + 1;
+    }
+    if (idx->hint == -1) {
+        idx->hint = end;
+    }
+    idx->next = dir_indexes;
+    dir_indexes = idx;
+    return idx;
+}
 
-    i = 0;
-    while (i < N_BLOCKS) {
-        blk = inode.blocks[i];
-        if (blk != -1) {
-            dnum = raid0_offset(blk);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(blk)] + sb.d_blocks_ptr;
-            off_t start = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            for (off_t ptr = start; ptr < start + BLOCK_SIZE; ptr += sizeof(struct wfs_dentry)) {
-                memcpy(&dentry, (void*)ptr, sizeof(struct wfs_dentry));
-                if (strcmp(dentry.name, name) == 0) {
-                    printf("[DEBUG] found existing data with name %s\n", name);
-                    return dentry.num;
+void dir_index_drop(int inum) {
+    struct dir_index **link;
+    struct dir_index *idx;
+    struct dir_name *entry;
+
+    for (link = &dir_indexes; *link != NULL; link = &(*link)->next) {
+        if ((*link)->inum == inum) {
+            idx = *link;
+            *link = idx->next;
+            for (long b = 0; b < idx->nbuckets; b++) {
+                while ((entry = idx->buckets[b]) != NULL) {
+                    idx->buckets[b] = entry->next;
+                    free(entry);
                 }
             }
+            free(idx->buckets);
+            free(idx);
+            return;
         }
-        i++;
+    }
+}
+
+// inum of the live entry called name in a directory, or -1
+int dir_lookup(struct wfs_inode *inode, const char *name) {
+    struct dir_index *idx;
+    struct dir_name **link;
+    struct wfs_dentry *entries;
+    int blk;
+
+    if ((idx = dir_index_get(inode)) != NULL) {
+        link = dir_index_find(inode, idx, name);
+        return *link != NULL ? dir_dentry(inode, (*link)->slot, (*link)->d)->num : -1;
+    }
+    for (long n = 0; (blk = dir_next(inode, &n)) != -1; n++) {
+        entries = (struct wfs_dentry*)fetch_block(blk);
+        for (int d = 0; d < dentries; d++) {
+            if (entries[d].num != -1 && strncmp(entries[d].name, name, MAX_NAME) == 0) {
+                return entries[d].num;
+            }
+        }
+    }
+    return -1;
+}
+
+int isdirempty(int inum) {
+    printf("[DEBUG] inside isdirempty\n");
+    struct wfs_inode inode;
+    struct dir_index *idx;
+    struct wfs_dentry *entries;
+    int blk;
+
+    inode = fetch_inode(inum);
+    if ((idx = dir_index_get(&inode)) != NULL) {
+        return idx->count == 0;
+    }
+    for (long n = 0; (blk = dir_next(&inode, &n)) != -1; n++) {
+        entries = (struct wfs_dentry*)fetch_block(blk);
+        for (int d = 0; d < dentries; d++) {
+            if (entries[d].num != -1) {
+                printf("[DEBUG] directory not empty\n");
+                return 0;
+            }
+        }
+    }
+    printf("[DEBUG] directory is empty\n");
+    return 1;
+}
+
+int data_exists(const char* name, int inum) {
+    printf("[DEBUG] inside data_exists\n");
+    struct wfs_inode inode;
+    int num;
+
+    inode = fetch_inode(inum);
+    if ((num = dir_lookup(&inode, name)) != -1) {
+        printf("[DEBUG] found existing data with name %s\n", name);
+        return num;
     }
     printf("[DEBUG] no existing data found with name %s\n", name);
     return -1;
 }
 
+/*
+  Deduplication (WFS_F_DEDUP). Full blocks of regular files are hashed
+  with CRC32C once written and shared with an identical indexed block;
+  hash matches are confirmed with memcmp. Shared blocks are copied before
+  they are modified. The hash index is kept in memory only and rebuilt
+  from the inode table at mount, like block_refs.
+*/
+
+// per dnum: inode pointers to the block; NULL unless blocks can be shared
+int *block_refs;
+
+struct dedup_state {
+    int *next;          // per dnum: next block in the same bucket, -1 ends the chain
+    uint32_t *hash;     // per dnum: hash the block is indexed under
+    unsigned char *indexed;
+    int *heads;
+    long nbuckets;
+} dedup;
+
+void dedup_index(int dnum, uint32_t h) {
+    long b = h & (dedup.nbuckets - 1);
+
+    dedup.hash[dnum] = h;
+    dedup.next[dnum] = dedup.heads[b];
+    dedup.heads[b] = dnum;
+    dedup.indexed[dnum] = 1;
+}
+
+// called before an indexed block changes or is freed
+void dedup_unindex(int dnum) {
+    int *link;
+
+    if (dedup.indexed == NULL || !dedup.indexed[dnum]) {
+        return;
+    }
+    for (link = &dedup.heads[dedup.hash[dnum] & (dedup.nbuckets - 1)]; *link != -1; link = &dedup.next[*link]) {
+        if (*link == dnum) {
+            *link = dedup.next[dnum];
+            break;
+        }
+    }
+    dedup.indexed[dnum] = 0;
+}
+
+// an indexed block other than dnum with the same contents, or -1
+int dedup_lookup(int dnum, uint32_t h) {
+    void *data = (void*)fetch_block(dnum);
+
+    for (int c = dedup.heads[h & (dedup.nbuckets - 1)]; c != -1; c = dedup.next[c]) {
+        if (c != dnum && dedup.hash[c] == h && memcmp((void*)fetch_block(c), data, BLOCK_SIZE) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/*
+  Free space counters. The allocators adjust wfs_sb.free_inodes,
+  free_blocks and disk_free_blocks as they flip bitmap bits, so statfs
+  reads them instead of scanning the bitmaps. Every disk carries the same
+  copy, like the feature flags; fsck.wfs recounts them after a crash.
+*/
+void count_free(long inodes, int disk, long blocks) {
+    struct wfs_sb sb;
+    size_t len = sizeof(struct wfs_sb) - offsetof(struct wfs_sb, free_inodes);
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    sb.free_inodes += inodes;
+    sb.free_blocks += blocks;
+    for (int i = 0; i < total_disks; i++) {
+        // mirrored bitmaps all change together
+        if (raid != RAID_0 || i == disk) {
+            sb.disk_free_blocks[i] += blocks;
+        }
+    }
+    // a metadata tier keeps them to itself, so creates never write to data disks
+    for (int i = meta_disks > 0 ? total_disks : 0; i < total_disks + meta_disks; i++) {
+        memcpy((char*)disk_ptrs[i] + offsetof(struct wfs_sb, free_inodes), &sb.free_inodes, len);
+    }
+}
+
+/*
+  Discard (--discard). Freed data blocks are not filled with 0xFF; each
+  run of consecutive blocks that free_datablocks releases is punched out
+  of the backing image with FALLOC_FL_PUNCH_HOLE instead, so the host
+  gives the space back and the block reads as zeros. Free space is
+  trimmed the same way at mount, after which every free block is zero
+  and allocation needs no fill either, except that new directory blocks
+  still get their -1 dentries. Checksums of discarded blocks are reset to
+  0 (not verified). Images on filesystems without hole punching are
+  zeroed through the mapping instead.
+*/
+int discard;
+int *disk_fds;
+
+// release [off, off + len) of the data region on disk, or on every mirror
+void discard_range(int disk, off_t off, size_t len) {
+    uint32_t *csum;
+
+    for (int i = 0; i < total_disks; i++) {
+        if (raid == RAID_0 && i != disk) {
+            continue;
+        }
+        if (disk_fds == NULL || disk_fds[i] < 0 ||
+            fallocate(disk_fds[i], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) != 0) {
+            memset((void*)((off_t)disk_ptrs[i] + off), 0, len);
+        }
+        for (off_t b = off; b < off + len; b += BLOCK_SIZE) {
+            if ((csum = checksum_ptr(disk_ptrs[i], b)) != 0) {
+                *csum = 0;
+            }
+        }
+    }
+}
+
+/*
+  A freed run rarely covers whole host pages on its own, and punching a
+  partial page only zeroes it. The run is widened over free neighbours up
+  to page boundaries first, so space comes back as soon as the blocks
+  around it are free as well.
+*/
+void discard_run(int disk, unsigned char *dbitmap, long first, long run) {
+    struct wfs_sb sb;
+    long page = sysconf(_SC_PAGESIZE);
+    long start = first, end = first + run;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    while (start > 0 && (sb.d_blocks_ptr + start * BLOCK_SIZE) % page != 0 &&
+           (dbitmap[(start - 1) / 8] & (1 << ((start - 1) % 8))) == 0) {
+        start--;
+    }
+    while (end < sb.disk_blocks[disk] && (sb.d_blocks_ptr + end * BLOCK_SIZE) % page != 0 &&
+           (dbitmap[end / 8] & (1 << (end % 8))) == 0) {
+        end++;
+    }
+    discard_range(disk, sb.d_blocks_ptr + start * BLOCK_SIZE, (end - start) * BLOCK_SIZE);
+}
+
+// punch every run of free data blocks, once at mount
+void discard_free() {
+    struct wfs_sb sb;
+    unsigned char *dbitmap;
+    long i, start;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    for (int disk = 0; disk < total_disks; disk++) {
+        // RAID1 mirrors share the main disk's bitmap
+        if (raid != RAID_0 && disk > 0) {
+            break;
+        }
+        dbitmap = (unsigned char*)disk_ptrs[disk] + sb.d_bitmap_ptr;
+        for (i = 0; i < sb.disk_blocks[disk]; i++) {
+            if (dbitmap[i / 8] & (1 << (i % 8))) {
+                continue;
+            }
+            for (start = i; i < sb.disk_blocks[disk] && (dbitmap[i / 8] & (1 << (i % 8))) == 0; i++);
+            discard_range(disk, sb.d_blocks_ptr + start * BLOCK_SIZE, (i - start) * BLOCK_SIZE);
+        }
+    }
+}
+
 struct wfs_inode* alloc_inode(mode_t mode) {
     void *disk_ptr = maindisk;
     printf("[DEBUG] inside alloc_inode\n");
     struct wfs_sb sb;
-    off_t i_bitmap_ptr;
+    unsigned char *inodebitmap;
+    unsigned char byte;
     off_t i_blocks_ptr;
-    int inodesize;
-    int free_i;
+    int free_i = -1;
     time_t ctime;
-    int i;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    inodesize = roundup(sb.num_inodes, 8) / 8;
-    unsigned char inodebitmap[inodesize];
-    i_bitmap_ptr = (off_t)disk_ptr + sb.i_bitmap_ptr;
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
-    memcpy(&inodebitmap, (void*)i_bitmap_ptr, inodesize);
-
-    for (i = 0; i < sb.num_inodes; i++) {
-        if ((inodebitmap[i / 8] & (1 << (i % 8))) == 0) {
-            free_i = i;
-            break;
+    // the bitmap is scanned where it is mapped and only the changed byte is written
+    inodebitmap = (unsigned char*)disk_ptr + sb.i_bitmap_ptr;
+    for (int b = 0; b < roundup(sb.num_inodes, 8) / 8 && free_i == -1; b++) {
+        if (inodebitmap[b] == 0xFF) {
+            continue;
+        }
+        for (int i = b * 8; i < b * 8 + 8 && i < sb.num_inodes; i++) {
+            if ((inodebitmap[b] & (1 << (i % 8))) == 0) {
+                free_i = i;
+                break;
+            }
         }
     }
-    if (i >= sb.num_inodes) {
+    if (free_i == -1) {
         printf("[DEBUG] all inodes full\n");
         return 0;
     }
-    inodebitmap[free_i / 8] |= (1 << (free_i % 8));
-    memcpy_v(i_bitmap_ptr, &inodebitmap, inodesize, 1);
+    byte = inodebitmap[free_i / 8] | (1 << (free_i % 8));
+    memcpy_v((off_t)&inodebitmap[free_i / 8], &byte, 1, 1);
+    count_free(-1, 0, 0);
 
-    i = 0;
-    while (i != free_i) {
-        i_blocks_ptr += BLOCK_SIZE;
-        i++;
-    }
+    i_blocks_ptr = inode_ptr(free_i);
 
     ctime = time(NULL);
     struct wfs_inode new_inode = {
@@ -360,96 +1323,246 @@ struct wfs_inode* alloc_inode(mode_t mode) {
         .ctim = ctime,
     };
     memset(new_inode.blocks, -1, N_BLOCKS*(sizeof(off_t)));
-    memcpy_v(i_blocks_ptr, &new_inode, sizeof(struct wfs_inode), 1);
+    if (inline_capacity(sb) > 0) {
+        // clear stale inline data left behind by a previous owner of the slot
+        unsigned char slot[BLOCK_SIZE] = {0};
+        memcpy(slot, &new_inode, sizeof(struct wfs_inode));
+        memcpy_v(i_blocks_ptr, slot, inode_slot_size(sb), 1);
+    }
+    else {
+        memcpy_v(i_blocks_ptr, &new_inode, sizeof(struct wfs_inode), 1);
+    }
     printf("[DEBUG] successfully allocated new inode\n");
     return (struct wfs_inode*)i_blocks_ptr;
 }
 
-int alloc_datablock() {
+/*
+  Data block placement. RAID1 allocates from the main disk's bitmap,
+  which every mirror copies. In RAID0 each disk allocates from its own
+  bitmap. A file's next block goes to the disk picked by a smooth
+  weighted round robin over disk_weights: every disk with free space
+  gains its weight in credit, the one with the most credit is picked and
+  pays the total back. Equal weights give plain round robin, so
+  consecutive blocks of a file land on successive disks; otherwise each
+  disk takes its share of a stream, interleaved as evenly as the weights
+  allow. A block with no predecessor (a file's first block, directory
+  blocks) goes to the disk with the most free blocks per unit of weight,
+  so the disks also fill in proportion. A full disk is skipped. alloc_hint is the
+  first bitmap byte of each disk that may still have a clear bit.
+*/
+long alloc_hint[MAX_DISKS];
+long alloc_credit[MAX_DISKS];
+
+// disk for a block following prev (-1: none), or -1 if every disk is full
+int alloc_disk(struct wfs_sb sb, int prev) {
+    long total = 0;
+    int disk = -1;
+
+    if (raid != RAID_0) {
+        return sb.disk_free_blocks[0] > 0 ? 0 : -1;
+    }
+    for (int i = 0; i < total_disks; i++) {
+        if (sb.disk_free_blocks[i] == 0) {
+            continue;
+        }
+        if (prev == -1) {
+            if (disk == -1 || sb.disk_free_blocks[i] * sb.disk_weights[disk] > sb.disk_free_blocks[disk] * sb.disk_weights[i]) {
+                disk = i;
+            }
+            continue;
+        }
+        alloc_credit[i] += sb.disk_weights[i];
+        total += sb.disk_weights[i];
+        if (disk == -1 || alloc_credit[i] > alloc_credit[disk]) {
+            disk = i;
+        }
+    }
+    if (disk != -1 && prev != -1) {
+        alloc_credit[disk] -= total;
+    }
+    return disk;
+}
+
+// first clear bit of a disk's data bitmap from its hint on, or -1
+long alloc_bit(struct wfs_sb sb, int disk) {
+    unsigned char *dbitmap = (unsigned char*)disk_ptrs[disk] + sb.d_bitmap_ptr;
+    long nbytes = roundup(sb.disk_blocks[disk], 8) / 8;
+    long b, bit, lo, hi;
+
+    // mid restripe part of the disk has no block numbers to hand out
+    restripe_gap(disk, &lo, &hi);
+    for (long n = 0; n < nbytes; n++) {
+        // wraps around once in case the hint ran past a free bit
+        b = (alloc_hint[disk] + n) % nbytes;
+        if (dbitmap[b] == 0xFF) {
+            continue;
+        }
+        if (b * 8 >= lo && (b + 1) * 8 <= hi) {
+            // step over the rest of the gap at once
+            n += (hi / 8 < nbytes ? hi / 8 : nbytes) - b - 1;
+            continue;
+        }
+        for (bit = b * 8; bit < b * 8 + 8 && bit < sb.disk_blocks[disk]; bit++) {
+            if ((dbitmap[b] & (1 << (bit % 8))) == 0 && (bit < lo || bit >= hi)) {
+                alloc_hint[disk] = b;
+                return bit;
+            }
+        }
+    }
+    return -1;
+}
+
+// a new data block, placed after prev, the file's preceding block or -1
+int alloc_datablock(int prev) {
     void *disk_ptr = maindisk;
     printf("[DEBUG] inside alloc_datablock\n");
     struct wfs_sb sb;
+    unsigned char byte;
     off_t d_bitmap_ptr;
     off_t d_blocks_ptr;
-    int dblocksize;
+    long free_d;
+    int disk, i;
     int idx;
-    int free_d;
-    int i, j;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    dblocksize = roundup(sb.num_data_blocks, 8) / 8;
-    unsigned char dbitmap[dblocksize];
-    d_bitmap_ptr = (off_t)disk_ptr + sb.d_bitmap_ptr;
-    memcpy(&dbitmap, (void*)d_bitmap_ptr, dblocksize);
-
-    int found = 0;
-    for (i = 0; i < sb.num_data_blocks; i++) {
-        for (j = 0; j < total_disks; j++) {
-            if ((dbitmap[i / 8] & (1 << (i % 8))) == 0) {
-                idx = raid0_idx(j, i);
-                free_d = i;
-                found = 1;
-                printf("[DEBUG] block free on disk %d, offset %d\n", j, i);
-                break;
+    if ((disk = alloc_disk(sb, prev)) != -1 && (free_d = alloc_bit(sb, disk)) == -1) {
+        // mid restripe a disk may have free blocks but no block numbers for them
+        int tried = disk;
+        for (disk = -1, i = 1; disk == -1 && i < total_disks; i++) {
+            if (sb.disk_free_blocks[(tried + i) % total_disks] > 0 && (free_d = alloc_bit(sb, (tried + i) % total_disks)) != -1) {
+                disk = (tried + i) % total_disks;
             }
         }
-        if (found) break;
     }
-    if (!found) {
-        return 0;
+    if (disk == -1) {
+        return -1;
     }
-    d_blocks_ptr = (off_t)disk_ptrs[j] + sb.d_blocks_ptr;
-    dbitmap[free_d / 8] |= (1 << (free_d % 8));
-    memcpy_v(d_bitmap_ptr, &dbitmap, dblocksize, 0);
+    printf("[DEBUG] block free on disk %d, offset %ld\n", disk, free_d);
+    idx = raid0_idx(disk, free_d);
+    d_bitmap_ptr = (off_t)disk_ptrs[disk] + sb.d_bitmap_ptr;
+    byte = ((unsigned char*)d_bitmap_ptr)[free_d / 8] | (1 << (free_d % 8));
+    memcpy_v(d_bitmap_ptr + free_d / 8, &byte, 1, 0);
+    count_free(0, disk, -1);
 
-    i = 0;
-    while (i != free_d) {
-        d_blocks_ptr += BLOCK_SIZE;
-        i++;
+    d_blocks_ptr = (off_t)disk_ptrs[disk] + sb.d_blocks_ptr + free_d * BLOCK_SIZE;
+    // discarded blocks are already zero
+    if (!discard) {
+        memset((void*)d_blocks_ptr, -1, BLOCK_SIZE);
+        memcpy_v(d_blocks_ptr, (void*)d_blocks_ptr, BLOCK_SIZE, 0);
+    }
+    if (block_refs != NULL) {
+        block_refs[idx] = 1;
     }
-    memset((void*)d_blocks_ptr, -1, BLOCK_SIZE);
-    memcpy_v(d_blocks_ptr, (void*)d_blocks_ptr, BLOCK_SIZE, 0);
     printf("[DEBUG] successfully allocated empty block\n");
     return idx;
 }
 
-int free_dentry(int p_inum, int c_inum) {
-    void *disk_ptr = maindisk;
+/*
+  Dentry blocks of a metadata tier come from the DBITMAP of the metadata
+  images, which every image of the tier mirrors. They are never shared,
+  so they have no block_refs and no free space counter; freeing one only
+  clears its bit and alloc_dirblock fills it again. meta_hint is the
+  first bitmap byte that may still have a clear bit.
+*/
+long meta_hint;
+
+// a dentry block of the metadata tier, or -1 if it is full
+int alloc_metablock() {
+    struct wfs_sb sb;
+    unsigned char *dbitmap;
+    unsigned char byte;
+    long nbytes, b;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    dbitmap = (unsigned char*)maindisk + sb.d_bitmap_ptr;
+    nbytes = roundup(sb.meta_blocks, 8) / 8;
+    for (long n = 0; n < nbytes; n++) {
+        b = (meta_hint + n) % nbytes;
+        if (dbitmap[b] == 0xFF) {
+            continue;
+        }
+        for (long bit = b * 8; bit < b * 8 + 8 && bit < sb.meta_blocks; bit++) {
+            if ((dbitmap[b] & (1 << (bit % 8))) == 0) {
+                byte = dbitmap[b] | (1 << (bit % 8));
+                memcpy_v((off_t)&dbitmap[b], &byte, 1, 1);
+                meta_hint = b;
+                return META_BASE + bit;
+            }
+        }
+    }
+    return -1;
+}
+
+void free_metablock(int dnum) {
+    struct wfs_sb sb;
+    unsigned char *dbitmap;
+    unsigned char byte;
+    long bit = dnum - META_BASE;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    dbitmap = (unsigned char*)maindisk + sb.d_bitmap_ptr;
+    byte = dbitmap[bit / 8] & ~(1 << (bit % 8));
+    memcpy_v((off_t)&dbitmap[bit / 8], &byte, 1, 1);
+    if (bit / 8 < meta_hint) {
+        meta_hint = bit / 8;
+    }
+}
+
+// dentry blocks the metadata tier has left
+long meta_free() {
+    struct wfs_sb sb;
+    long n = 0;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    for (long i = 0; i < sb.meta_blocks; i++) {
+        n += (((unsigned char*)maindisk)[sb.d_bitmap_ptr + i / 8] & (1 << (i % 8))) == 0;
+    }
+    return n;
+}
+
+int free_dentry(int p_inum, int c_inum, const char *name) {
     printf("[DEBUG] in free_dentry\n");
     struct wfs_inode inode;
-    struct wfs_sb sb;
+    struct dir_index *idx;
+    struct dir_name **link;
+    struct wfs_dentry *entries, *found;
     struct wfs_dentry dentry;
-    off_t i_blocks_ptr;
-    off_t d_blocks_ptr;
     int blk;
-    int dnum;
-    int i;
 
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
     inode = fetch_inode(p_inum);
+    if ((idx = dir_index_get(&inode)) != NULL) {
+        for (link = dir_index_find(&inode, idx, name); *link != NULL; link = dir_index_match(&inode, &(*link)->next, (*link)->hash, name)) {
+            found = dir_dentry(&inode, (*link)->slot, (*link)->d);
+            if (found->num == c_inum) {
+                dentry = *found;
+                dentry.num = -1;
+                memcpy_v((off_t)found, &dentry, sizeof(struct wfs_dentry), 0);
+                idx->hint = (*link)->slot < idx->hint ? (*link)->slot : idx->hint;
+                dir_index_unlink(idx, link);
+                inode.mtim = time(NULL);
+                memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+                printf("[DEBUG] successfully freed dentry with inum %d\n", c_inum);
+                return 1;
+            }
+        }
+        printf("[DEBUG] no dentry found with inum %d\n", c_inum);
+        return 0;
+    }
 
-    i = 0;
-    while (i < N_BLOCKS) {
-        blk = inode.blocks[i];
-        if (blk != -1) {
-            dnum = raid0_offset(blk);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(blk)] + sb.d_blocks_ptr;
-            off_t start = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            for (off_t ptr = start; ptr < start + BLOCK_SIZE; ptr += sizeof(struct wfs_dentry)) {
-                memcpy(&dentry, (void*)ptr, sizeof(struct wfs_dentry));
-                if (dentry.num == c_inum) {
-                    dentry.num = -1;
-                    memcpy_v(ptr, &dentry, sizeof(struct wfs_dentry), 0);
-                    /*inode.size -= sizeof(dentry);*/
-                    inode.mtim = time(NULL);
-                    memcpy_v((i_blocks_ptr + (inode.num * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
-                    printf("[DEBUG] successfully freed dentry with inum %d\n", c_inum);
-                    return 1;
-                }
+    for (long n = 0; (blk = dir_next(&inode, &n)) != -1; n++) {
+        entries = (struct wfs_dentry*)fetch_block(blk);
+        for (int d = 0; d < dentries; d++) {
+            if (entries[d].num == c_inum) {
+                dentry = entries[d];
+                dentry.num = -1;
+                memcpy_v((off_t)&entries[d], &dentry, sizeof(struct wfs_dentry), 0);
+                /*inode.size -= sizeof(dentry);*/
+                inode.mtim = time(NULL);
+                memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+                printf("[DEBUG] successfully freed dentry with inum %d\n", c_inum);
+                return 1;
             }
         }
-        i++;
     }
     printf("[DEBUG] no dentry found with inum %d\n", c_inum);
     return 0;
@@ -460,58 +1573,158 @@ void free_inode(int inum) {
     printf("[DEBUG] in free_inode\n");
     struct wfs_inode inode;
     struct wfs_sb sb;
-    off_t i_bitmap_ptr;
-    off_t i_blocks_ptr;
-    int inodesize;
+    unsigned char *inodebitmap;
+    unsigned char byte;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    inodesize = roundup(sb.num_inodes, 8) / 8;
-    unsigned char inodebitmap[inodesize];
-    i_bitmap_ptr = (off_t)disk_ptr + sb.i_bitmap_ptr;
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
-    memcpy(&inodebitmap, (void*)i_bitmap_ptr, inodesize);
+    inodebitmap = (unsigned char*)disk_ptr + sb.i_bitmap_ptr;
     inode = fetch_inode(inum);
 
     inode.num = -1;
-    inodebitmap[inum / 8] &= ~(1 << (inum % 8));
-    memcpy_v((i_blocks_ptr + (inum * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
-    memcpy_v(i_bitmap_ptr, &inodebitmap, inodesize, 1);
+    byte = inodebitmap[inum / 8] & ~(1 << (inum % 8));
+    memcpy_v(inode_ptr(inum), &inode, sizeof(struct wfs_inode), 1);
+    memcpy_v((off_t)&inodebitmap[inum / 8], &byte, 1, 1);
+    count_free(1, 0, 0);
     printf("[DEBUG] successfully freed inode with inum %d\n", inum);
 }
 
-void free_datablock(int dnum) {
-    printf("[DEBUG] inside free_datablock\n");
-    int parsed_dnum = raid0_offset(dnum);
-    void *disk_ptr = disk_ptrs[raid0_disk(dnum)];
+// order blocks by disk, then by offset on that disk
+int cmp_dnum(const void *a, const void *b) {
+    int da = *(const int*)a, db = *(const int*)b;
+
+    if (raid0_disk(da) != raid0_disk(db)) {
+        return raid0_disk(da) - raid0_disk(db);
+    }
+    return raid0_offset(da) - raid0_offset(db);
+}
+
+/*
+  Releases n data blocks at once. Blocks are grouped per disk and into
+  runs of consecutive offsets: each run is filled with one copy and each
+  disk's bitmap is written back once, covering only the bytes that
+  changed. Deleting or truncating a file costs one update per extent
+  rather than a bitmap copy per block. Shared blocks only lose a reference.
+*/
+void free_datablocks(int *dnums, int n) {
+    void *disk_ptr;
     struct wfs_sb sb;
-    off_t d_bitmap_ptr;
+    unsigned char *dbitmap;
     off_t d_blocks_ptr;
     off_t b_ptr;
-    int dblocksize;
+    int *order;
+    int count, disk, first, run, lo, hi, freed;
+    int i, j, k, b;
 
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    dblocksize = roundup(sb.num_data_blocks, 8) / 8;
-    unsigned char dbitmap[dblocksize];
-    d_bitmap_ptr = (off_t)disk_ptr + sb.d_bitmap_ptr;
-    d_blocks_ptr = (off_t)disk_ptr + sb.d_blocks_ptr;
-    memcpy(&dbitmap, (void*)d_bitmap_ptr, dblocksize);
-
-    b_ptr = d_blocks_ptr + (parsed_dnum * BLOCK_SIZE);
-    memset((void*)b_ptr, -1, BLOCK_SIZE);
-    dbitmap[parsed_dnum / 8] &= ~(1 << (parsed_dnum % 8));
-    memcpy_v(d_bitmap_ptr, &dbitmap, dblocksize, 0);
+    if (n <= 0) {
+        return;
+    }
+    order = malloc(n * sizeof(int));
+    count = 0;
+    for (i = 0; i < n; i++) {
+        if (dnums[i] >= META_BASE) {
+            free_metablock(dnums[i]);
+            continue;
+        }
+        if (block_refs != NULL) {
+            if (--block_refs[dnums[i]] > 0) {
+                continue;
+            }
+            dedup_unindex(dnums[i]);
+        }
+        order[count++] = dnums[i];
+    }
+    qsort(order, count, sizeof(int), cmp_dnum);
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    for (i = 0; i < count; i = j) {
+        disk = raid0_disk(order[i]);
+        disk_ptr = disk_ptrs[disk];
+        // bits are cleared where the bitmap is mapped, then the changed bytes written through once
+        dbitmap = (unsigned char*)disk_ptr + sb.d_bitmap_ptr;
+        d_blocks_ptr = (off_t)disk_ptr + sb.d_blocks_ptr;
+        lo = INT_MAX;
+        hi = 0;
+        freed = 0;
+        for (j = i; j < count && raid0_disk(order[j]) == disk; j = k) {
+            first = raid0_offset(order[j]);
+            for (k = j + 1; k < count && raid0_disk(order[k]) == disk &&
+                 raid0_offset(order[k]) == first + (k - j); k++);
+            run = k - j;
+            for (b = first; b < first + run; b++) {
+                dbitmap[b / 8] &= ~(1 << (b % 8));
+            }
+            b_ptr = d_blocks_ptr + (first * BLOCK_SIZE);
+            if (discard) {
+                discard_run(disk, dbitmap, first, run);
+            }
+            else {
+                memset((void*)b_ptr, -1, run * BLOCK_SIZE);
+                memcpy_v(b_ptr, (void*)b_ptr, run * BLOCK_SIZE, 0);
+            }
+            freed += run;
+            lo = min(lo, first / 8);
+            hi = (first + run - 1) / 8 > hi ? (first + run - 1) / 8 : hi;
+        }
+        memcpy_v((off_t)&dbitmap[lo], &dbitmap[lo], hi - lo + 1, 0);
+        count_free(0, disk, freed);
+        if (lo < alloc_hint[disk]) {
+            alloc_hint[disk] = lo;
+        }
+    }
+    free(order);
+}
+
+void free_datablock(int dnum) {
+    printf("[DEBUG] inside free_datablock\n");
+    free_datablocks(&dnum, 1);
     printf("[DEBUG] successfully freed datablock with dnum %d\n", dnum);
 }
 
+// release a whole tree: file data, directory blocks and the inodes
+void free_tree(int inum) {
+    struct wfs_inode inode;
+    struct wfs_dentry entries[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+    int *dnums;
+    int blk;
+    int n = 0;
+
+    inode = fetch_inode(inum);
+    dnums = malloc((dir_slots(&inode) + DIR_FANOUT + 1) * sizeof(int));
+    if (S_ISDIR(inode.mode)) {
+        for (long s = 0; (blk = dir_next(&inode, &s)) != -1; s++) {
+            memcpy(entries, (void*)fetch_block(blk), BLOCK_SIZE);
+            for (int d = 0; d < dentries; d++) {
+                if (entries[d].num != -1) {
+                    free_tree(entries[d].num);
+                }
+            }
+            dnums[n++] = blk;
+        }
+        n += dir_tree_blocks(&inode, dnums + n);
+        dir_index_drop(inum);
+    }
+    else {
+        for (int i = 0; i < N_BLOCKS; i++) {
+            if (inode.blocks[i] != -1) {
+                dnums[n++] = inode.blocks[i];
+            }
+        }
+    }
+    free_datablocks(dnums, n);
+    free(dnums);
+    zcache_drop(inum);
+    free_inode(inum);
+}
+
 int free_dir(int inum, int p_inum, const char *name) {
     printf("[DEBUG] inside free_dir \n");
 
     // clear dentry in parent
-    if (free_dentry(p_inum, inum) != 1) {
+    if (free_dentry(p_inum, inum, name) != 1) {
         return 0;
     }
-    // clear inode
-    free_inode(inum);
+    // clear directory blocks and inode
+    free_tree(inum);
 
     return 1;
     printf("[DEBUG] successfully freed directory entry of %d from %d\n", inum, p_inum);
@@ -523,31 +1736,34 @@ int free_file(int inum, int p_inum, const char *name) {
     printf("[DEBUG] inside free_file \n");
     struct wfs_inode inode;
     struct wfs_sb sb;
-    off_t i_blocks_ptr;
+    int dnums[N_BLOCKS];
     int blk;
+    int n;
     int i;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
     inode = fetch_inode(inum);
 
     // clear dentry in parent
-    if (free_dentry(p_inum, inum) != 1) {
+    if (free_dentry(p_inum, inum, name) != 1) {
         return 0;
     }
 
     // clear file data
+    zcache_drop(inum);
     i = 0;
+    n = 0;
     while (i < N_BLOCKS) {
         blk = inode.blocks[i];
         if (blk != -1) {
-            free_datablock(blk);
+            dnums[n++] = blk;
             inode.blocks[i] = -1;
             /*inode.size -= BLOCK_SIZE;*/
         }
         i++;
     }
-    memcpy_v((i_blocks_ptr + (inode.num * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
+    memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+    free_datablocks(dnums, n);
 
     // clear inode
     free_inode(inum);
@@ -556,72 +1772,292 @@ int free_file(int inum, int p_inum, const char *name) {
     return 1;
 }
 
-struct wfs_dentry* fetch_available_block(int inum) {
-    void *disk_ptr = maindisk;
+// a directory block with every entry and block number set to -1
+int alloc_dirblock() {
+    off_t b_ptr;
+    int dnum;
+
+    if ((dnum = meta_disks > 0 ? alloc_metablock() : alloc_datablock(-1)) == -1) {
+        return -1;
+    }
+    // discarded blocks come back zeroed, freed dentry blocks as they were
+    if (discard || dnum >= META_BASE) {
+        b_ptr = fetch_block(dnum);
+        memset((void*)b_ptr, -1, BLOCK_SIZE);
+        memcpy_v(b_ptr, (void*)b_ptr, BLOCK_SIZE, 0);
+    }
+    return dnum;
+}
+
+// put dentry block dnum in slot n, turning the directory into a tree when blocks[] runs out
+int dir_set_block(struct wfs_inode *inode, long n, int dnum) {
+    int *index;
+    int root, ptrs, leaf;
+    long k;
+
+    if (n < IND_BLOCK || (n == IND_BLOCK && !(inode->mode & WFS_S_DIRTREE))) {
+        inode->blocks[n] = dnum;
+        memcpy_v(inode_ptr(inode->num), inode, sizeof(struct wfs_inode), 1);
+        return 0;
+    }
+    if (n >= IND_BLOCK + DIR_FANOUT * DIR_FANOUT) {
+        return -1;
+    }
+    if (!(inode->mode & WFS_S_DIRTREE)) {
+        // the old last block becomes slot IND_BLOCK, the first tree leaf
+        if ((root = alloc_dirblock()) == -1) {
+            return -1;
+        }
+        if ((ptrs = alloc_dirblock()) == -1) {
+            free_datablock(root);
+            return -1;
+        }
+        leaf = inode->blocks[IND_BLOCK];
+        memcpy_v(fetch_block(ptrs), &leaf, sizeof(int), 0);
+        memcpy_v(fetch_block(root), &ptrs, sizeof(int), 0);
+        inode->blocks[IND_BLOCK] = root;
+        inode->mode |= WFS_S_DIRTREE;
+        memcpy_v(inode_ptr(inode->num), inode, sizeof(struct wfs_inode), 1);
+    }
+    k = n - IND_BLOCK;
+    index = (int*)fetch_block(inode->blocks[IND_BLOCK]);
+    if (index[k / DIR_FANOUT] == -1) {
+        if ((ptrs = alloc_dirblock()) == -1) {
+            return -1;
+        }
+        memcpy_v((off_t)&index[k / DIR_FANOUT], &ptrs, sizeof(int), 0);
+    }
+    memcpy_v(fetch_block(index[k / DIR_FANOUT]) + (k % DIR_FANOUT) * sizeof(int), &dnum, sizeof(int), 0);
+    return 0;
+}
+
+// a free dentry of directory inum, adding a dentry block if needed; *slot gets its block's slot
+struct wfs_dentry* fetch_available_block(int inum, long *slot) {
     printf("[DEBUG] inside fetch_available_block\n");
     struct wfs_inode inode;
-    struct wfs_sb sb;
-    off_t i_blocks_ptr;
+    struct dir_index *idx;
+    struct wfs_dentry *dentry;
+    long n, next;
     int blk;
     int new_dnum;
-    int i;
 
-    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
     inode = fetch_inode(inum);
     printf("[DEBUG] reading from inode %d\n", inode.num);
 
-    // get dentry from existing datablock
-    i = 0;
-    while (i < N_BLOCKS) {
-        blk = inode.blocks[i];
-        printf("Block: %d\n", blk);
-        if (blk != -1) {
-            printf("[DEBUG] found existing datablock\n");
-            if (fetch_empty_dentry(blk) != 0) {
-                return fetch_empty_dentry(blk);
+    // get dentry from existing datablock, skipping the blocks known to be full
+    idx = dir_index_get(&inode);
+    next = idx != NULL ? idx->hint : 0;
+    for (n = next; (blk = dir_next(&inode, &n)) != -1; n++) {
+        if ((dentry = fetch_empty_dentry(blk)) != 0) {
+            if (idx != NULL) {
+                idx->hint = n;
             }
+            *slot = n;
+            return dentry;
         }
-        i++;
+        next = n + 1;
     }
-    // try to create new datablock and fetch dentry
-    i = 0;
+    // used slots form a prefix, so the new block goes right after them
     printf("[DEBUG] creating new datablock\n");
-    while (i < N_BLOCKS) {
-        blk = inode.blocks[i];
-        if (blk == -1) {
-            new_dnum = alloc_datablock();
-            printf("[DEBUG] allocated new datablock at %d\n", new_dnum);
-            inode.blocks[i] = new_dnum;
-            printf("[DEBUG] writing to inode %d\n", inode.num);
-            memcpy_v((i_blocks_ptr + (inum * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
-            struct wfs_inode test = fetch_inode(inum);
-            for (int j = 0; j < N_BLOCKS; j++) {
-                printf("Verifying block: %ld\n", test.blocks[j]);
-            }
-            printf("[DEBUG] successfully created new dentry\n");
-            return fetch_empty_dentry(new_dnum);
-        }
-        i++;
+    if ((new_dnum = alloc_dirblock()) == -1) {
+        return 0;
+    }
+    if (dir_set_block(&inode, next, new_dnum) == -1) {
+        free_datablock(new_dnum);
+        printf("[DEBUG] failed to create new empty dentry\n");
+        return 0;
+    }
+    if (idx != NULL) {
+        idx->hint = next;
+    }
+    printf("[DEBUG] allocated new datablock at %d, slot %ld\n", new_dnum, next);
+    *slot = next;
+    return fetch_empty_dentry(new_dnum);
+}
+
+// make blocks[blk] private to this inode before it is modified in place
+int unshare_block(struct wfs_inode *inode, int blk) {
+    int dnum = inode->blocks[blk];
+    int new_dnum;
+
+    if (block_refs == NULL || dnum == -1) {
+        return 0;
+    }
+    if (block_refs[dnum] == 1) {
+        dedup_unindex(dnum);
+        return 0;
+    }
+    if ((new_dnum = alloc_datablock(blk > 0 ? inode->blocks[blk - 1] : -1)) == -1) {
+        return -1;
     }
-    printf("[DEBUG] failed to create new empty dentry\n");
+    memcpy_v(fetch_block(new_dnum), (void*)fetch_block(dnum), BLOCK_SIZE, 0);
+    block_refs[dnum]--;
+    inode->blocks[blk] = new_dnum;
+    memcpy_v(inode_ptr(inode->num), inode, sizeof(struct wfs_inode), 1);
     return 0;
 }
 
+// share a freshly written full block with an identical one, or index it
+void dedup_block(struct wfs_inode *inode, int blk) {
+    int dnum = inode->blocks[blk];
+    int match;
+    uint32_t h;
+
+    if (dedup.heads == NULL || dnum == -1 || dedup.indexed[dnum]) {
+        return;
+    }
+    h = crc32c((void*)fetch_block(dnum), BLOCK_SIZE);
+    if ((match = dedup_lookup(dnum, h)) == -1) {
+        dedup_index(dnum, h);
+        return;
+    }
+    block_refs[match]++;
+    inode->blocks[blk] = match;
+    free_datablock(dnum);
+}
+
+// decompressed contents of a compressed file, from the cache or its blocks
+struct zcache_entry* fetch_compressed(struct wfs_inode inode) {
+    unsigned char stream[N_BLOCKS * BLOCK_SIZE];
+    struct zcache_entry *entry;
+    uint32_t clen;
+    off_t b_ptr;
+    int nblk;
+
+    if ((entry = zcache_lookup(inode.num)) != NULL) {
+        return entry;
+    }
+    nblk = 1;
+    for (int blk = 0; blk < nblk; blk++) {
+        if (inode.blocks[blk] == -1 ||
+            (b_ptr = verified_ptr(fetch_block(inode.blocks[blk]), BLOCK_SIZE)) == 0) {
+            return NULL;
+        }
+        memcpy(stream + blk * BLOCK_SIZE, (void*)b_ptr, BLOCK_SIZE);
+        if (blk == 0) {
+            // the stream length in block 0 says how many blocks to gather
+            memcpy(&clen, stream, sizeof(clen));
+            if (clen > sizeof(stream) - sizeof(clen)) {
+                return NULL;
+            }
+            nblk = roundup(clen + sizeof(clen), BLOCK_SIZE) / BLOCK_SIZE;
+        }
+    }
+    entry = zcache_insert(inode.num);
+    if (lz_decompress(stream + sizeof(clen), clen, entry->data, sizeof(entry->data)) != inode.size) {
+        fprintf(stderr, "wfs: corrupt compressed stream in inode %d\n", inode.num);
+        entry->used = 0;
+        return NULL;
+    }
+    entry->size = inode.size;
+    return entry;
+}
+
+int read_blocks(int inum, const char *buffer, size_t size, off_t offset);
+
+// rewrite a whole file as a compressed stream, or raw if that is not smaller
+int write_compressed(struct wfs_inode inode, const char *buffer, size_t size, off_t offset) {
+    unsigned char plain[N_BLOCKS * BLOCK_SIZE];
+    unsigned char stream[N_BLOCKS * BLOCK_SIZE];
+    struct zcache_entry *entry;
+    int fresh[N_BLOCKS] = {0};
+    int tail[N_BLOCKS];
+    uint32_t clen;
+    off_t newsize;
+    size_t len;
+    int nblk, rc, dnum, i;
+    int nfree = 0;
+    int packed;
+
+    if (offset >= sizeof(plain)) {
+        return -ENOSPC;
+    }
+    size = min(size, sizeof(plain) - offset);
+
+    // current contents, whether inline, raw or compressed
+    memset(plain, 0, sizeof(plain));
+    if (inode.size > 0 && (rc = read_blocks(inode.num, (char*)plain, inode.size, 0)) < 0) {
+        return rc;
+    }
+    memcpy(plain + offset, buffer, size);
+    newsize = offset + size > inode.size ? offset + size : inode.size;
+
+    rc = lz_compress(plain, newsize, stream + sizeof(clen), sizeof(stream) - sizeof(clen));
+    packed = rc >= 0 && roundup(rc + sizeof(clen), BLOCK_SIZE) < roundup(newsize, BLOCK_SIZE);
+    if (packed) {
+        clen = rc;
+        memcpy(stream, &clen, sizeof(clen));
+        len = clen + sizeof(clen);
+        inode.mode |= WFS_S_COMPRESSED;
+    }
+    else {
+        memcpy(stream, plain, newsize);
+        len = newsize;
+        inode.mode &= ~WFS_S_COMPRESSED;
+    }
+    nblk = roundup(len, BLOCK_SIZE) / BLOCK_SIZE;
+
+    for (i = 0; i < nblk; i++) {
+        if (inode.blocks[i] != -1 && unshare_block(&inode, i) == 0) {
+            continue;
+        }
+        if (inode.blocks[i] != -1 || (dnum = alloc_datablock(i > 0 ? inode.blocks[i - 1] : -1)) == -1) {
+            for (i = 0; i < nblk; i++) {
+                if (fresh[i]) {
+                    free_datablock(inode.blocks[i]);
+                }
+            }
+            return -ENOSPC;
+        }
+        inode.blocks[i] = dnum;
+        fresh[i] = 1;
+    }
+    for (i = 0; i < nblk; i++) {
+        memcpy_v(fetch_block(inode.blocks[i]), stream + i * BLOCK_SIZE, min(BLOCK_SIZE, len - i * BLOCK_SIZE), 0);
+    }
+    for (i = 0; (i + 1) * BLOCK_SIZE <= len; i++) {
+        dedup_block(&inode, i);
+    }
+    // a smaller stream hands back the tail blocks
+    for (i = nblk; i < N_BLOCKS; i++) {
+        if (inode.blocks[i] != -1) {
+            tail[nfree++] = inode.blocks[i];
+            inode.blocks[i] = -1;
+        }
+    }
+    inode.size = newsize;
+    inode.mtim = time(NULL);
+    memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+    free_datablocks(tail, nfree);
+
+    if (packed) {
+        entry = zcache_insert(inode.num);
+        memcpy(entry->data, plain, newsize);
+        entry->size = newsize;
+    }
+    else {
+        zcache_drop(inode.num);
+    }
+    return size;
+}
+
 int read_blocks(int inum, const char *buffer, size_t size, off_t offset) {
     printf("[DEBUG] inside read_blocks\n");
     void *disk_ptr = maindisk;
+    struct zcache_entry *entry;
     struct wfs_inode inode;
     struct wfs_sb sb;
-    off_t d_blocks_ptr, b_ptr;
+    off_t b_ptr;
     size_t bytes_read, to_read;
     int blk, blk_offset;
-    int dnum;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
     inode = fetch_inode(inum);
     if (!S_ISREG(inode.mode)) {
         printf("[DEBUG] incorrect mode - can only read from file\n");
+        return -EISDIR;
+    }
+    if (offset >= inode.size) {
         return 0;
     }
 
@@ -630,201 +2066,1669 @@ int read_blocks(int inum, const char *buffer, size_t size, off_t offset) {
     size = min(size, inode.size - offset);
     printf("[DEBUG] adjusted size: %ld\n", size);
 
+    if (isinline(inode, sb)) {
+        b_ptr = inode_ptr(inum) + sizeof(struct wfs_inode);
+        memcpy((void*)buffer, (void*)(b_ptr + offset), size);
+        return size;
+    }
+    if (inode.mode & WFS_S_COMPRESSED) {
+        if ((entry = fetch_compressed(inode)) == NULL) {
+            return -EIO;
+        }
+        memcpy((void*)buffer, entry->data + offset, size);
+        return size;
+    }
+
     bytes_read = 0;
     printf("[DEBUG] offset: %ld\n", offset);
     while (bytes_read < size) {
         blk = (offset + bytes_read) / BLOCK_SIZE;
         blk_offset = (offset + bytes_read) % BLOCK_SIZE;
         if (blk < N_BLOCKS) {
-            dnum = raid0_offset(blk);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(blk)] + sb.d_blocks_ptr;
-            b_ptr = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            /*to_read = ((size - bytes_read) / BLOCK_SIZE) >= 1 ? BLOCK_SIZE : (size - bytes_read);*/
             to_read = min(BLOCK_SIZE - blk_offset, size - bytes_read);
-
             printf("[DEBUG] bytes to read: %ld\n", to_read);
-            memcpy((void*)(buffer + bytes_read), (void*)(b_ptr + blk_offset), to_read);
+            if (inode.blocks[blk] == -1) {
+                memset((void*)(buffer + bytes_read), 0, to_read);
+            }
+            else {
+                if ((b_ptr = verified_ptr(fetch_block(inode.blocks[blk]), BLOCK_SIZE)) == 0) {
+                    return -EIO;
+                }
+                memcpy((void*)(buffer + bytes_read), (void*)(b_ptr + blk_offset), to_read);
+            }
             bytes_read += to_read;
-            printf("[DEBUG] bytes successfully read: %ld\n", to_read);
         }
         else {
-            return 0;
+            break;
         }
     }
+    printf("[DEBUG] bytes successfully read: %ld\n", bytes_read);
     return bytes_read;
 }
 
-int write_blocks(int inum, const char *buffer, size_t size, off_t offset) {
-    printf("[DEBUG] inside write_blocks\n");
+/*
+  Zero-copy reads, low-level frontend only. ll_read answers with a bufvec
+  that refers to the image files instead of a filled buffer: one fd entry
+  per run of blocks stored back to back on the same disk, which libfuse
+  can splice from the page cache the mappings share instead of copying
+  through a reply buffer. libfuse frees every memory entry along with the
+  bufvec, so entries cannot point into the mappings themselves; holes get
+  a zeroed heap entry instead. Inline and compressed files have no blocks
+  to refer to and are read into a heap buffer.
+  The fd entries are only good while fs_lock is held: a truncate, discard
+  or restripe may free or move the blocks as soon as it is dropped, so
+  ll_read sends its reply before unlocking. The high-level frontend cannot,
+  since libfuse replies after read_buf returns; it has no read_buf and
+  serves reads through wfs_read.
+*/
+// bufvec for [offset, offset + size) of inum; 1 if the file has to be read into a buffer
+int map_read(int inum, struct fuse_bufvec **bufp, size_t size, off_t offset) {
     void *disk_ptr = maindisk;
-    struct wfs_inode inode;
     struct wfs_sb sb;
-    off_t i_blocks_ptr, d_blocks_ptr, b_ptr;
-    size_t bytes_written, to_write;
-    int blk, blk_offset;
-    int dnum;
-    int new_dnum;
+    struct wfs_inode inode;
+    struct fuse_bufvec *bv;
+    struct fuse_buf *last;
+    off_t b_ptr, pos;
+    size_t done, len;
+    int blk, blk_offset, disk;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)disk_ptr + sb.i_blocks_ptr;
     inode = fetch_inode(inum);
     if (!S_ISREG(inode.mode)) {
-        printf("[DEBUG] incorrect mode - can only write to file\n");
-        return 0;
+        return -EISDIR;
+    }
+    if (isinline(inode, sb) || (inode.mode & WFS_S_COMPRESSED)) {
+        return 1;
     }
+    size = offset < inode.size ? min(size, inode.size - offset) : 0;
 
-    bytes_written = 0;
-    printf("[DEBUG] size: %ld\n", size);
-    printf("[DEBUG] offset: %ld\n", offset);
-    while (bytes_written < size) {
-        blk = (offset + bytes_written) / BLOCK_SIZE;
-        blk_offset = (offset + bytes_written) % BLOCK_SIZE;
-        if (blk < N_BLOCKS) {
-            new_dnum = alloc_datablock();
-            inode.blocks[blk] = new_dnum;
-            memcpy_v((i_blocks_ptr + (inode.num * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
-            dnum = raid0_offset(new_dnum);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(new_dnum)] + sb.d_blocks_ptr;
-            b_ptr = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            /*to_write = ((size - bytes_written) / BLOCK_SIZE) >= 1 ? BLOCK_SIZE : (size - bytes_written);*/
-            to_write = min(BLOCK_SIZE - blk_offset, size - bytes_written);
-            printf("[DEBUG] bytes to write: %ld\n", to_write);
-            memcpy_v(b_ptr + blk_offset, (void*)(buffer + bytes_written), to_write, 0);
-            bytes_written += to_write;
-            printf("[DEBUG] bytes successfully written: %ld\n", to_write);
+    bv = malloc(sizeof(struct fuse_bufvec) + N_BLOCKS * sizeof(struct fuse_buf));
+    *bv = FUSE_BUFVEC_INIT(0);
+    bv->count = 0;
+    for (done = 0; done < size; done += len) {
+        blk = (offset + done) / BLOCK_SIZE;
+        blk_offset = (offset + done) % BLOCK_SIZE;
+        len = min(BLOCK_SIZE - blk_offset, size - done);
+        last = bv->count > 0 ? &bv->buf[bv->count - 1] : NULL;
+        if (inode.blocks[blk] == -1) {
+            bv->buf[bv->count++] = (struct fuse_buf) { .size = len, .mem = calloc(1, len), .fd = -1 };
+            continue;
         }
-        else {
-            return 0;
+        // the checksummed copy to serve, which may be a mirror's
+        if ((b_ptr = verified_ptr(fetch_block(inode.blocks[blk]), BLOCK_SIZE)) == 0) {
+            for (size_t i = 0; i < bv->count; i++) {
+                free(bv->buf[i].mem);
+            }
+            free(bv);
+            return -EIO;
+        }
+        disk = owning_disk(b_ptr);
+        pos = b_ptr + blk_offset - (off_t)disk_ptrs[disk];
+        if (last != NULL && last->fd == disk_fds[disk] && last->pos + (off_t)last->size == pos) {
+            last->size += len;
+            continue;
         }
+        bv->buf[bv->count++] = (struct fuse_buf) {
+            .size = len, .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK, .fd = disk_fds[disk], .pos = pos
+        };
     }
-    inode.mtim = time(NULL);
-    inode.size += size;
-    memcpy_v((i_blocks_ptr + (inode.num * BLOCK_SIZE)), &inode, sizeof(struct wfs_inode), 1);
-    return bytes_written;
+    *bufp = bv;
+    return 0;
 }
 
-int read_dentries(int inum, char *buffer, fuse_fill_dir_t filler) {
-    printf("[DEBUG] inside read_dentries\n");
+// move inline file data out of the inode slot into a regular data block
+int promote_inline(struct wfs_inode *inode) {
     void *disk_ptr = maindisk;
-    struct wfs_inode inode;
     struct wfs_sb sb;
-    struct wfs_dentry dentry;
-    off_t d_blocks_ptr;
-    int blk;
-    int dnum;
-    int i;
+    off_t i_ptr, b_ptr;
+    int new_dnum;
 
     memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
-    inode = fetch_inode(inum);
-
-    i = 0;
-    while (i < N_BLOCKS) {
-        blk = inode.blocks[i];
-        printf("block: %d\n", blk);
-        if (blk != -1) {
-            dnum = raid0_offset(blk);
-            d_blocks_ptr = (off_t)disk_ptrs[raid0_disk(blk)] + sb.d_blocks_ptr;
-            off_t start = d_blocks_ptr + (dnum * BLOCK_SIZE);
-            for (off_t ptr = start; ptr < start + BLOCK_SIZE; ptr += sizeof(struct wfs_dentry)) {
-                memcpy(&dentry, (void*)ptr, sizeof(struct wfs_dentry));
-                if (dentry.num != -1) {
-                    filler(buffer, dentry.name, NULL, 0);
-                }
-            }
-        }
-        i++;
+    i_ptr = inode_ptr(inode->num);
+    if (inode->size == 0) {
+        return 0;
     }
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
-    printf("[DEBUG] successfully fetched dentries\n");
-    return 1;
+    if ((new_dnum = alloc_datablock(-1)) == -1) {
+        return -1;
+    }
+    b_ptr = fetch_block(new_dnum);
+    memcpy_v(b_ptr, (void*)(i_ptr + sizeof(struct wfs_inode)), inode->size, 0);
+    inode->blocks[0] = new_dnum;
+    memcpy_v(i_ptr, inode, sizeof(struct wfs_inode), 1);
+    return 0;
 }
 
-static int wfs_getattr(const char *path, struct stat *stbuf) {
-    printf("\n******* inside getattr *******\n");
-    struct wfs_inode inode;
-    struct timespec tim;
-    int inum;
+/*
+  Truncation and holes. A block pointer of -1 inside a file is a hole and
+  reads as zeros without being allocated. Bytes past EOF in an allocated
+  block or in the inline slot are not kept zeroed, so every operation that
+  moves EOF forward clears the gap first with zero_range. Punching a hole
+  releases the whole blocks in the range with free_datablocks and zeroes
+  the partial blocks at either end.
+*/
+#define MAX_FILE_SIZE (N_BLOCKS * BLOCK_SIZE)
 
-    memset(stbuf, 0, sizeof(struct stat));
+// zero [from, to) of a file's stored data; holes are skipped
+int zero_range(struct wfs_inode *inode, off_t from, off_t to) {
+    void *disk_ptr = maindisk;
+    unsigned char zeros[BLOCK_SIZE] = {0};
+    struct wfs_sb sb;
+    off_t off, end;
+    int blk;
 
-    printf("[DEBUG] path %s\n", path);
-    if ((inum = validatepath(path)) == -1) {
-        return -ENOENT;
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if (inode->mode & WFS_S_COMPRESSED) {
+        return 0;
+    }
+    if (isinline(*inode, sb)) {
+        to = min(to, inline_capacity(sb));
+        if (from < to) {
+            memcpy_v(inode_ptr(inode->num) + sizeof(struct wfs_inode) + from, zeros, to - from, 1);
+        }
+        return 0;
+    }
+    for (off = from; off < to && off < MAX_FILE_SIZE; off = end) {
+        blk = off / BLOCK_SIZE;
+        end = min((blk + 1) * BLOCK_SIZE, to);
+        if (inode->blocks[blk] == -1) {
+            continue;
+        }
+        if (unshare_block(inode, blk) == -1) {
+            return -ENOSPC;
+        }
+        memcpy_v(fetch_block(inode->blocks[blk]) + (off % BLOCK_SIZE), zeros, end - off, 0);
     }
-    inode = fetch_inode(inum);
-    printf("[DEBUG] fetching inode %d\n", inode.num);
-    stbuf->st_uid = inode.uid;
-    stbuf->st_gid = inode.gid;
-    stbuf->st_mode = inode.mode;
-    stbuf->st_size = inode.size;
-    tim.tv_sec = inode.atim;
-    stbuf->st_atim = tim;
-    tim.tv_sec = inode.mtim;
-    stbuf->st_mtim = tim;
-    printf("[DEBUG] populated stbuf %d\n", inode.num);
-    printf("[DEBUG] size %ld\n", stbuf->st_size);
-    printf("[DEBUG] mode %d\n", stbuf->st_mode);
-    printf("[DEBUG] uid %d\n", stbuf->st_uid);
-    printf("[DEBUG] gid %d\n", stbuf->st_gid);
     return 0;
 }
 
-static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    printf("\n******* inside mknod *******\n");
-    int p_inum;
-    int existing_inum;
-    void *curr_disk = maindisk;
-    const char *name;
-    const char *parentpath;
+// turn [from, to) into a hole, releasing every whole block inside it
+int punch_range(struct wfs_inode *inode, off_t from, off_t to) {
+    void *disk_ptr = maindisk;
+    unsigned char zeros[BLOCK_SIZE] = {0};
     struct wfs_sb sb;
-    struct wfs_inode *new_inode;
-    struct wfs_inode p_inode;
-    struct wfs_inode existing_inode;
-    struct wfs_dentry *block_ptr;
-    off_t i_blocks_ptr;
-    mode_t file_mode = mode | S_IFREG;
+    int dnums[N_BLOCKS];
+    int first, last;
+    int n = 0;
+    int rc;
 
-    if (path == NULL || strlen(path) == 0) {
-        return -ENOENT;
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    to = min(to, MAX_FILE_SIZE);
+    if (from >= to) {
+        return 0;
     }
-    name = getname(path);
-    parentpath = getparentpath(path);
-
-    memcpy(&sb, curr_disk, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)curr_disk + sb.i_blocks_ptr;
-    if ((p_inum = validatepath(parentpath)) == -1) {
-        return -ENOENT;
+    if (isinline(*inode, sb)) {
+        return zero_range(inode, from, to);
     }
-    if ((existing_inum = data_exists(name, p_inum)) != -1) {
-        existing_inode = fetch_inode(existing_inum);
-        if (S_ISREG(existing_inode.mode))
-            return -EEXIST;
+    first = roundup(from, BLOCK_SIZE) / BLOCK_SIZE;
+    last = to / BLOCK_SIZE;
+    if ((rc = zero_range(inode, from, min(to, first * BLOCK_SIZE))) < 0) {
+        return rc;
     }
-    if ((new_inode = alloc_inode(file_mode)) == 0) {
-        printf("[DEBUG] no more space for file inode\n");
-        return -ENOSPC;
-    };
-    if ((block_ptr = fetch_available_block(p_inum)) == 0) {
-        printf("[DEBUG] no more space for file datablock\n");
-        return -ENOSPC;
+    if (last >= first && (rc = zero_range(inode, last * BLOCK_SIZE, to)) < 0) {
+        return rc;
+    }
+    for (int blk = first; blk < last; blk++) {
+        if (inode->blocks[blk] != -1) {
+            dnums[n++] = inode->blocks[blk];
+            inode->blocks[blk] = -1;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    inode->mtim = time(NULL);
+    memcpy_v(inode_ptr(inode->num), inode, sizeof(struct wfs_inode), 1);
+    free_datablocks(dnums, n);
+    // without block 0 a small file reads from its inline slot again
+    if (inline_capacity(sb) > 0 && inode->blocks[0] == -1) {
+        memcpy_v(inode_ptr(inode->num) + sizeof(struct wfs_inode), zeros, inline_capacity(sb), 1);
     }
-    struct wfs_dentry new_dentry = {
-        .num = new_inode->num
-    };
-    strcpy(new_dentry.name, name);
-    memcpy_v((off_t)block_ptr, &new_dentry, sizeof(struct wfs_dentry), 0);
-    p_inode = fetch_inode(p_inum);
-    /*p_inode.size += sizeof(new_dentry);*/
-    p_inode.mtim = time(NULL);
-    /*p_inode.nlinks++;*/
-    memcpy_v((i_blocks_ptr + (p_inode.num * BLOCK_SIZE)), &p_inode, sizeof(struct wfs_inode), 1);
-    printf("[DEBUG] successfully created new file\n");
+    return 0;
+}
+
+// compressed files are rewritten whole, with [from, to) cleared and the new size
+int resize_compressed(struct wfs_inode inode, off_t from, off_t to, off_t size) {
+    unsigned char plain[MAX_FILE_SIZE] = {0};
+    int rc;
+
+    if (inode.size > 0 && (rc = read_blocks(inode.num, (char*)plain, inode.size, 0)) < 0) {
+        return rc;
+    }
+    to = min(to, MAX_FILE_SIZE);
+    if (from < to) {
+        memset(plain + from, 0, to - from);
+    }
+    if (size < inode.size) {
+        memset(plain + size, 0, inode.size - size);
+    }
+    inode.size = size;
+    rc = write_compressed(inode, (char*)plain, size, 0);
+    return rc < 0 ? rc : 0;
+}
+
+int truncate_file(int inum, off_t size) {
+    void *disk_ptr = maindisk;
+    struct wfs_inode inode;
+    struct wfs_sb sb;
+    int rc;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    inode = fetch_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+        return -EISDIR;
+    }
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    if (inode.mode & WFS_S_COMPRESSED) {
+        return resize_compressed(inode, 0, 0, size);
+    }
+
+    if (size > inode.size) {
+        if (isinline(inode, sb) && size > inline_capacity(sb) && promote_inline(&inode) == -1) {
+            return -ENOSPC;
+        }
+        rc = zero_range(&inode, inode.size, size);
+    }
+    else if (isinline(inode, sb)) {
+        rc = zero_range(&inode, size, inode.size);
+    }
+    else {
+        // the tail of the last block is past EOF and left alone
+        rc = punch_range(&inode, roundup(size, BLOCK_SIZE), MAX_FILE_SIZE);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+    inode.size = size;
+    inode.mtim = time(NULL);
+    memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+    return 0;
+}
+
+/*
+  fallocate modes: 0 and FALLOC_FL_KEEP_SIZE allocate zeroed blocks for the
+  range, PUNCH_HOLE (always with KEEP_SIZE) releases them. A failed
+  allocation hands back the blocks it had taken.
+*/
+int fallocate_file(int inum, int mode, off_t offset, off_t length) {
+    void *disk_ptr = maindisk;
+    unsigned char zeros[BLOCK_SIZE] = {0};
+    struct wfs_inode inode;
+    struct wfs_sb sb;
+    int fresh[N_BLOCKS];
+    int nfresh = 0;
+    off_t end;
+    int dnum, rc;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) ||
+        ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    inode = fetch_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+        return -EISDIR;
+    }
+    end = offset + length;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (inode.mode & WFS_S_COMPRESSED) {
+            return offset < inode.size ? resize_compressed(inode, offset, end, inode.size) : 0;
+        }
+        return punch_range(&inode, offset, end);
+    }
+    if (end > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    if (inode.mode & WFS_S_COMPRESSED) {
+        // a compressed stream has no per-offset blocks to reserve
+        if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode.size) {
+            return resize_compressed(inode, 0, 0, end);
+        }
+        return 0;
+    }
+
+    if (isinline(inode, sb) && end > inline_capacity(sb) && promote_inline(&inode) == -1) {
+        return -ENOSPC;
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode.size && (rc = zero_range(&inode, inode.size, end)) < 0) {
+        return rc;
+    }
+    if (!isinline(inode, sb) || end > inline_capacity(sb)) {
+        for (int blk = offset / BLOCK_SIZE; blk < roundup(end, BLOCK_SIZE) / BLOCK_SIZE; blk++) {
+            if (inode.blocks[blk] != -1) {
+                continue;
+            }
+            if ((dnum = alloc_datablock(blk > 0 ? inode.blocks[blk - 1] : -1)) == -1) {
+                free_datablocks(fresh, nfresh);
+                return -ENOSPC;
+            }
+            if (!discard) {
+                memcpy_v(fetch_block(dnum), zeros, BLOCK_SIZE, 0);
+            }
+            inode.blocks[blk] = dnum;
+            fresh[nfresh++] = dnum;
+        }
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode.size) {
+        inode.size = end;
+    }
+    inode.mtim = time(NULL);
+    memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+    return 0;
+}
+
+/*
+  Spliced writes. write_buf can hand write_blocks the request as libfuse
+  received it, usually still sitting in a pipe. Its data is then read
+  straight into the destination blocks of the main copy and mirrored
+  from there, like memcpy_v does, instead of going through a request
+  buffer first. Paths that transform the data gather it into memory.
+*/
+// copy a bufvec into one heap buffer; returns its length or a negative errno
+ssize_t gather_buf(struct fuse_bufvec *src, char **data) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+    ssize_t n;
+
+    *data = malloc(dst.buf[0].size);
+    dst.buf[0].mem = *data;
+    if ((n = fuse_buf_copy(&dst, src, 0)) < 0) {
+        free(*data);
+        *data = NULL;
+    }
+    return n;
+}
+
+// fill len bytes at dst_ptr from src; returns the bytes copied
+ssize_t copy_from_buf(off_t dst_ptr, size_t len, struct fuse_bufvec *src) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    ssize_t n;
+
+    dst.buf[0].mem = (void*)dst_ptr;
+    if ((n = fuse_buf_copy(&dst, src, 0)) > 0) {
+        update_checksums(dst_ptr, n);
+        if (raid != RAID_0) {
+            mirror_range(dst_ptr, n);
+        }
+    }
+    return n;
+}
+
+// write size bytes from buffer, or from src when it is not NULL, at offset
+int write_blocks(int inum, const char *buffer, struct fuse_bufvec *src, size_t size, off_t offset) {
+    printf("[DEBUG] inside write_blocks\n");
+    void *disk_ptr = maindisk;
+    unsigned char zeros[BLOCK_SIZE] = {0};
+    struct wfs_inode inode;
+    struct wfs_sb sb;
+    off_t b_ptr;
+    size_t bytes_written, to_write;
+    int blk, blk_offset;
+    int new_dnum;
+    char *data;
+    ssize_t n;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    inode = fetch_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+        printf("[DEBUG] incorrect mode - can only write to file\n");
+        return -EISDIR;
+    }
+    if (src != NULL && ((isinline(inode, sb) && offset + size <= inline_capacity(sb)) ||
+                        (inode.mode & WFS_S_COMPRESSED) || compress)) {
+        if ((n = gather_buf(src, &data)) < 0) {
+            return n;
+        }
+        n = write_blocks(inum, data, NULL, n, offset);
+        free(data);
+        return n;
+    }
+
+    if (isinline(inode, sb) && offset + size <= inline_capacity(sb)) {
+        if (offset > inode.size) {
+            zero_range(&inode, inode.size, offset);
+        }
+        b_ptr = inode_ptr(inum) + sizeof(struct wfs_inode);
+        memcpy_v(b_ptr + offset, (void*)buffer, size, 1);
+        inode.mtim = time(NULL);
+        if (offset + size > inode.size) {
+            inode.size = offset + size;
+        }
+        memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+        return size;
+    }
+    if ((inode.mode & WFS_S_COMPRESSED) || compress) {
+        return write_compressed(inode, buffer, size, offset);
+    }
+    if (isinline(inode, sb) && promote_inline(&inode) == -1) {
+        return -ENOSPC;
+    }
+    // EOF moves forward: clear what lies between it and the write
+    if (offset > inode.size && zero_range(&inode, inode.size, offset) < 0) {
+        return -ENOSPC;
+    }
+
+    bytes_written = 0;
+    printf("[DEBUG] size: %ld\n", size);
+    printf("[DEBUG] offset: %ld\n", offset);
+    while (bytes_written < size) {
+        blk = (offset + bytes_written) / BLOCK_SIZE;
+        blk_offset = (offset + bytes_written) % BLOCK_SIZE;
+        if (blk < N_BLOCKS) {
+            to_write = min(BLOCK_SIZE - blk_offset, size - bytes_written);
+            if (inode.blocks[blk] == -1) {
+                if ((new_dnum = alloc_datablock(blk > 0 ? inode.blocks[blk - 1] : -1)) == -1) {
+                    break;
+                }
+                // bytes of the new block before EOF but outside the write were a hole
+                if (!discard && (blk_offset > 0 || blk * BLOCK_SIZE + blk_offset + to_write < inode.size)) {
+                    memcpy_v(fetch_block(new_dnum), zeros, BLOCK_SIZE, 0);
+                }
+                inode.blocks[blk] = new_dnum;
+                memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+            }
+            else if (unshare_block(&inode, blk) == -1) {
+                break;
+            }
+            printf("[DEBUG] bytes to write: %ld\n", to_write);
+            b_ptr = fetch_block(inode.blocks[blk]);
+            if (src == NULL) {
+                memcpy_v(b_ptr + blk_offset, (void*)(buffer + bytes_written), to_write, 0);
+            }
+            else if ((n = copy_from_buf(b_ptr + blk_offset, to_write, src)) < (ssize_t)to_write) {
+                // src ran dry
+                bytes_written += n > 0 ? n : 0;
+                break;
+            }
+            bytes_written += to_write;
+            if ((blk + 1) * BLOCK_SIZE <= offset + bytes_written || (blk + 1) * BLOCK_SIZE <= inode.size) {
+                dedup_block(&inode, blk);
+            }
+        }
+        else {
+            break;
+        }
+    }
+    printf("[DEBUG] bytes successfully written: %ld\n", bytes_written);
+    if (bytes_written == 0 && size > 0) {
+        return -ENOSPC;
+    }
+    inode.mtim = time(NULL);
+    if (offset + bytes_written > inode.size) {
+        inode.size = offset + bytes_written;
+    }
+    memcpy_v(inode_ptr(inode.num), &inode, sizeof(struct wfs_inode), 1);
+    return bytes_written;
+}
+
+/*
+  Entries are listed with offsets, so a directory too big for one reply
+  is read in pieces: the entry at dentry position p (slot * dentries + d)
+  gets offset p + 1, and "." and ".." come after every possible position.
+*/
+#define DIR_END ((off_t)(IND_BLOCK + DIR_FANOUT * DIR_FANOUT) * (BLOCK_SIZE / sizeof(struct wfs_dentry)))
+
+int read_dentries(int inum, char *buffer, fuse_fill_dir_t filler, off_t offset) {
+    printf("[DEBUG] inside read_dentries\n");
+    struct wfs_inode inode, child;
+    struct wfs_dentry *entries;
+    struct stat st;
+    long first;
+    int blk;
+
+    inode = fetch_inode(inum);
+
+    first = offset < DIR_END ? offset / dentries : DIR_END;
+    for (long n = first; (blk = dir_next(&inode, &n)) != -1; n++) {
+        entries = (struct wfs_dentry*)fetch_block(blk);
+        for (int d = n == first ? offset % dentries : 0; d < dentries; d++) {
+            if (entries[d].num == -1) {
+                continue;
+            }
+            // inode number and type, so the entry needs no lookup to be listed
+            memcpy(&child, (void*)inode_ptr(entries[d].num), sizeof(struct wfs_inode));
+            memset(&st, 0, sizeof(struct stat));
+            st.st_ino = entries[d].num + 1;
+            st.st_mode = child.mode & S_IFMT;
+            if (filler(buffer, entries[d].name, &st, n * dentries + d + 1)) {
+                return 1;
+            }
+        }
+    }
+    if (offset <= DIR_END && filler(buffer, ".", NULL, DIR_END + 1)) {
+        return 1;
+    }
+    if (offset <= DIR_END + 1) {
+        filler(buffer, "..", NULL, DIR_END + 2);
+    }
+    printf("[DEBUG] successfully fetched dentries\n");
+    return 1;
+}
+
+/*
+  Background scrubber. Walks the allocated inodes and data blocks of every
+  mirrored region, compares the copies on all disks and rewrites the
+  minority copies with the majority one. Throttled to scrub.rate units per
+  second and done in small batches under fs_lock so foreground operations
+  never wait on a whole pass. Status and control live in SCRUB_PATH.
+*/
+#define SCRUB_BATCH 32
+
+struct scrub_state {
+    pthread_t thread;
+    int running;
+    int stop;
+    int paused;
+    long rate;
+    long passes;
+    long position;
+    long total;
+    long checked;
+    long mismatches;
+    long repaired;
+    long unrepairable;
+} scrub = { .rate = 1024 };
+
+int region_equal(const void *a, const void *b, size_t len) {
+#if defined(__SSE2__)
+    const unsigned char *pa = a, *pb = b;
+    while (len >= sizeof(__m128i)) {
+        __m128i va = _mm_loadu_si128((const __m128i*)pa);
+        __m128i vb = _mm_loadu_si128((const __m128i*)pb);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+            return 0;
+        }
+        pa += sizeof(__m128i);
+        pb += sizeof(__m128i);
+        len -= sizeof(__m128i);
+    }
+    return memcmp(pa, pb, len) == 0;
+#else
+    return memcmp(a, b, len) == 0;
+#endif
+}
+
+// compare [off, off + len) across the mirror set of disk and repair by majority vote
+void scrub_range(int disk, off_t off, size_t len) {
+    struct wfs_sb sb;
+    int best = -1, bestvotes = 0, votes;
+    int n, first, end;
+
+    first = mirror_set(disk, &n);
+    end = first + n;
+    for (int i = first; i < end; i++) {
+        map_touch_range(i, off, len);
+    }
+    for (int i = first; i < end; i++) {
+        votes = 1;
+        for (int j = first; j < end; j++) {
+            if (j != i && region_equal((void*)((off_t)disk_ptrs[i] + off), (void*)((off_t)disk_ptrs[j] + off), len)) {
+                votes++;
+            }
+        }
+        if (votes > bestvotes) {
+            best = i;
+            bestvotes = votes;
+        }
+    }
+    scrub.checked++;
+    if (bestvotes == n) {
+        return;
+    }
+    scrub.mismatches++;
+
+    // no majority: let checksums break the tie when the filesystem has them
+    if (bestvotes * 2 <= n) {
+        memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+        best = -1;
+        for (int i = first; (sb.flags & WFS_F_CHECKSUM) && i < end; i++) {
+            if (blocks_valid(disk_ptrs[i], off, len)) {
+                best = i;
+                break;
+            }
+        }
+        if (best == -1) {
+            scrub.unrepairable++;
+            return;
+        }
+    }
+    for (int i = first; i < end; i++) {
+        if (i == best || region_equal((void*)((off_t)disk_ptrs[i] + off), (void*)((off_t)disk_ptrs[best] + off), len)) {
+            continue;
+        }
+        memcpy((void*)((off_t)disk_ptrs[i] + off), (void*)((off_t)disk_ptrs[best] + off), len);
+        update_checksums((off_t)disk_ptrs[i] + off, len);
+        scrub.repaired++;
+    }
+}
+
+// sleep long enough that `units` scrubbed units stay within scrub.rate
+void scrub_throttle(long units) {
+    struct timespec ts;
+    long ns;
+
+    if (scrub.rate <= 0) {
+        return;
+    }
+    ns = units * 1000000000L / scrub.rate;
+    ts.tv_sec = ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+    nanosleep(&ts, NULL);
+}
+
+int bit_set(off_t bitmap, long i) {
+    return (((unsigned char*)bitmap)[i / 8] & (1 << (i % 8))) != 0;
+}
+
+void scrub_pass() {
+    struct wfs_sb sb;
+    off_t i_bitmap_ptr, d_bitmap_ptr, m_bitmap_ptr;
+    long i, batch;
+    long ninodes, nblocks, ndata, nmeta, nunits;
+    int meta = meta_disks > 0 ? total_disks : 0;
+
+    pthread_mutex_lock(&fs_lock);
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    // bitmaps first, so the walk below follows repaired allocation state;
+    // a metadata tier mirrors its whole header, the data disks their data bitmap
+    if (meta_disks > 0) {
+        scrub_range(meta, sb.i_bitmap_ptr, sb.i_blocks_ptr - sb.i_bitmap_ptr);
+        if (raid != RAID_0) {
+            scrub_range(0, sb.d_bitmap_ptr, sb.i_blocks_ptr - sb.d_bitmap_ptr);
+        }
+    }
+    else if (raid == RAID_0) {
+        scrub_range(0, sb.i_bitmap_ptr, sb.d_bitmap_ptr - sb.i_bitmap_ptr);
+    }
+    else {
+        scrub_range(0, sb.i_bitmap_ptr, sb.i_blocks_ptr - sb.i_bitmap_ptr);
+    }
+    i_bitmap_ptr = (off_t)maindisk + sb.i_bitmap_ptr;
+    d_bitmap_ptr = (off_t)disk_ptrs[0] + sb.d_bitmap_ptr;
+    m_bitmap_ptr = (off_t)maindisk + sb.d_bitmap_ptr;
+    // RAID0 data blocks have a single copy, only the metadata is mirrored
+    ndata = raid == RAID_0 ? 0 : sb.num_data_blocks;
+    nmeta = meta_disks > 0 ? sb.meta_blocks : 0;
+    ninodes = nblocks = 0;
+    for (i = 0; i < sb.num_inodes; i++) {
+        ninodes += bit_set(i_bitmap_ptr, i);
+    }
+    for (i = 0; i < ndata; i++) {
+        nblocks += bit_set(d_bitmap_ptr, i);
+    }
+    for (i = 0; i < nmeta; i++) {
+        nblocks += bit_set(m_bitmap_ptr, i);
+    }
+    scrub.position = 0;
+    scrub.total = ninodes + nblocks;
+    pthread_mutex_unlock(&fs_lock);
+
+    nunits = sb.num_inodes + ndata + nmeta;
+    i = 0;
+    while (!scrub.stop && i < nunits) {
+        batch = 0;
+        pthread_mutex_lock(&fs_lock);
+        for (; i < nunits && batch < SCRUB_BATCH; i++) {
+            if (i < sb.num_inodes) {
+                if (!bit_set(i_bitmap_ptr, i)) continue;
+                scrub_range(meta, inode_ptr(i) - (off_t)maindisk, inode_slot_size(sb));
+            }
+            else if (i < sb.num_inodes + ndata) {
+                if (!bit_set(d_bitmap_ptr, i - sb.num_inodes)) continue;
+                scrub_range(0, sb.d_blocks_ptr + (i - sb.num_inodes) * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            else {
+                if (!bit_set(m_bitmap_ptr, i - sb.num_inodes - ndata)) continue;
+                scrub_range(meta, sb.d_blocks_ptr + (i - sb.num_inodes - ndata) * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            batch++;
+            scrub.position++;
+        }
+        pthread_mutex_unlock(&fs_lock);
+        scrub_throttle(batch);
+        while (scrub.paused && !scrub.stop) {
+            sleep(1);
+        }
+    }
+    scrub.passes++;
+}
+
+void* scrub_thread(void *arg) {
+    while (!scrub.stop) {
+        scrub_pass();
+        // idle between passes at the same rate as a full batch
+        scrub_throttle(SCRUB_BATCH);
+    }
+    return NULL;
+}
+
+/*
+  Online RAID0 expansion. Writing "add <image>" to RESTRIPE_PATH formats a
+  blank image as disk total_disks: superblock, inode bitmap and inode
+  table from the main disk, an empty data bitmap, and as many data blocks
+  as fit, up to num_data_blocks. Every superblock then records the new
+  disk with restripe_from set to the old disk count, and a background
+  thread moves the blocks to the wider stripe in dnum order, taking
+  restripe.rate blocks per second in batches under fs_lock.
+
+  A block's new place was the old place of a smaller block number, so it
+  is free once that block has moved. A batch only runs up to the first
+  block whose new place still holds a block at or past the cursor. Moved
+  blocks are copied and marked at their new place, then restripe_pos is
+  saved, then their old places are freed. An interrupted batch is simply
+  run again after the next mount; at worst a few old places stay marked
+  until fsck.wfs releases them. Adding is refused when some offset of the
+  old layout would not fit on its disk in the new one, which only
+  happens with disks of very different sizes.
+
+  "pause", "resume" and "rate <blocks/s>" control the thread, and reading
+  RESTRIPE_PATH reports its progress. Since "add" makes wfs open and
+  format any file it can reach, only the user who mounted wfs and root
+  may open RESTRIPE_PATH at all (ctl_access).
+*/
+#define RESTRIPE_BATCH 64
+
+void generate_id(int disk_index, char *id, size_t size) {
+    time_t ctime = time(NULL);
+    srand((unsigned) clock());
+    int random = rand();
+    snprintf(id, size, "%d-%ld-%d", disk_index, (long)ctime, random);
+}
+
+// write the cursor to every superblock
+void restripe_save() {
+    struct wfs_sb sb;
+    size_t len = sizeof(struct wfs_sb) - offsetof(struct wfs_sb, restripe_from);
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    sb.restripe_from = restripe.from;
+    sb.restripe_pos = restripe.pos;
+    for (int i = 0; i < total_disks + meta_disks; i++) {
+        memcpy((char*)disk_ptrs[i] + offsetof(struct wfs_sb, restripe_from), &sb.restripe_from, len);
+    }
+}
+
+// set or clear a data bitmap bit of a disk, keeping the free counters
+void restripe_mark(int disk, long offset, int used) {
+    struct wfs_sb sb;
+    unsigned char *byte;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    byte = (unsigned char*)disk_ptrs[disk] + sb.d_bitmap_ptr + offset / 8;
+    if (((*byte & (1 << (offset % 8))) != 0) == used) {
+        return;
+    }
+    *byte ^= 1 << (offset % 8);
+    count_free(0, disk, used ? -1 : 1);
+}
+
+// move the next run of block numbers to the new layout; returns blocks copied
+long restripe_batch() {
+    struct wfs_sb sb;
+    long start = restripe.pos, end, x, copied = 0;
+    long src_off, dst_off;
+    int src, dst, from = restripe.from;
+    uint32_t *src_csum, *dst_csum;
+    long moved[RESTRIPE_BATCH];
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    for (end = start; end < restripe.end && end - start < RESTRIPE_BATCH; end++) {
+        dst = end % total_disks;
+        dst_off = end / total_disks;
+        // the block at the new place has to be behind the cursor already
+        if (dst < from && dst_off * from + dst >= start && dst_off * from + dst != end) {
+            break;
+        }
+    }
+
+    for (x = start; x < end; x++) {
+        src = x % from;
+        src_off = x / from;
+        dst = x % total_disks;
+        dst_off = x / total_disks;
+        if (src == dst && src_off == dst_off) {
+            continue;
+        }
+        if (src_off < sb.disk_blocks[src] && bit_set((off_t)disk_ptrs[src] + sb.d_bitmap_ptr, src_off)) {
+            map_touch(src, sb.d_blocks_ptr + src_off * BLOCK_SIZE);
+            map_touch(dst, sb.d_blocks_ptr + dst_off * BLOCK_SIZE);
+            memcpy((char*)disk_ptrs[dst] + sb.d_blocks_ptr + dst_off * BLOCK_SIZE,
+                   (char*)disk_ptrs[src] + sb.d_blocks_ptr + src_off * BLOCK_SIZE, BLOCK_SIZE);
+            // the checksum moves along, so a bad block stays detectable
+            src_csum = checksum_ptr(disk_ptrs[src], sb.d_blocks_ptr + src_off * BLOCK_SIZE);
+            dst_csum = checksum_ptr(disk_ptrs[dst], sb.d_blocks_ptr + dst_off * BLOCK_SIZE);
+            if (src_csum != 0 && dst_csum != 0) {
+                *dst_csum = *src_csum;
+            }
+            restripe_mark(dst, dst_off, 1);
+            moved[copied++] = x;
+        }
+        else if (dst_off < sb.disk_blocks[dst]) {
+            // marked by a batch that was interrupted
+            restripe_mark(dst, dst_off, 0);
+        }
+    }
+
+    restripe.pos = end;
+    if (end >= restripe.end) {
+        restripe.from = 0;
+        restripe.pos = 0;
+    }
+    restripe_save();
+    for (long i = 0; i < copied; i++) {
+        src = moved[i] % from;
+        src_off = moved[i] / from;
+        restripe_mark(src, src_off, 0);
+        if (discard) {
+            discard_range(src, sb.d_blocks_ptr + src_off * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    restripe.moved += copied;
+    return copied;
+}
+
+void* restripe_thread(void *arg) {
+    struct timespec ts;
+    long copied, ns;
+
+    while (!restripe.stop && restripe.from != 0) {
+        pthread_mutex_lock(&fs_lock);
+        copied = restripe_batch();
+        pthread_mutex_unlock(&fs_lock);
+        if (restripe.rate > 0 && copied > 0) {
+            ns = copied * 1000000000L / restripe.rate;
+            ts.tv_sec = ns / 1000000000L;
+            ts.tv_nsec = ns % 1000000000L;
+            nanosleep(&ts, NULL);
+        }
+        while (restripe.paused && !restripe.stop) {
+            sleep(1);
+        }
+    }
+    return NULL;
+}
+
+void restripe_start() {
+    if (restripe.running) {
+        pthread_join(restripe.thread, NULL);
+        restripe.running = 0;
+    }
+    if (pthread_create(&restripe.thread, NULL, restripe_thread, NULL) == 0) {
+        restripe.running = 1;
+    }
+}
+
+// pick up a restripe recorded in the superblock, at mount
+void restripe_load() {
+    struct wfs_sb sb;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    if (raid != RAID_0 || sb.restripe_from == 0) {
+        return;
+    }
+    restripe.from = sb.restripe_from;
+    restripe.pos = sb.restripe_pos;
+    restripe.end = (long)restripe.from * sb.num_data_blocks;
+}
+
+// data blocks a blank image of size bytes holds as the next disk
+long restripe_capacity(struct wfs_sb sb, off_t size) {
+    long blocks = size > (off_t)sb.d_blocks_ptr ? (size - (off_t)sb.d_blocks_ptr) / BLOCK_SIZE : 0;
+    long itable = (sb.d_blocks_ptr - sb.i_blocks_ptr) / BLOCK_SIZE;
+
+    blocks = blocks < (long)sb.num_data_blocks ? blocks : (long)sb.num_data_blocks;
+    while ((sb.flags & WFS_F_CHECKSUM) && blocks > 0 &&
+           (off_t)(sb.d_blocks_ptr + blocks * BLOCK_SIZE + roundup((itable + blocks) * sizeof(uint32_t), BLOCK_SIZE)) > size) {
+        blocks--;
+    }
+    return blocks / 32 * 32;
+}
+
+int restripe_add(const char *path) {
+    struct wfs_sb sb, other;
+    struct stat st;
+    void *ptr, *ref = disk_ptrs[0];
+    long blocks, x, nblocks;
+    int fd, n = total_disks;
+    size_t len = sizeof(struct wfs_sb) - offsetof(struct wfs_sb, free_inodes);
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    if (raid != RAID_0 || n >= MAX_DISKS) {
+        return -EINVAL;
+    }
+    if (restripe.from != 0) {
+        return -EBUSY;
+    }
+    if ((fd = open(path, O_RDWR)) < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0 || (blocks = restripe_capacity(sb, st.st_size)) <= 0) {
+        close(fd);
+        return -ENOSPC;
+    }
+    // every block number of the old layout needs a place in the new one
+    for (int d = 0; d < n; d++) {
+        for (long o = 0; o < sb.disk_blocks[d]; o++) {
+            x = o * n + d;
+            if (x / (n + 1) >= (x % (n + 1) == n ? blocks : (long)sb.disk_blocks[x % (n + 1)])) {
+                close(fd);
+                return -EINVAL;
+            }
+        }
+    }
+    if ((ptr = mapdisk(fd)) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    // the array's superblock, now with the new disk in it
+    sb.num_disks = n + 1;
+    generate_id(n + 1, sb.disks[n], DISK_ID_SIZE);
+    sb.disk_blocks[n] = blocks;
+    sb.disk_free_blocks[n] = blocks;
+    sb.free_blocks += blocks;
+    sb.disk_weights[n] = (sb.disk_weights[0] * blocks + sb.disk_blocks[0] / 2) / sb.disk_blocks[0];
+    if (sb.disk_weights[n] < 1) {
+        sb.disk_weights[n] = 1;
+    }
+    sb.restripe_from = n;
+    sb.restripe_pos = 0;
+
+    // the new disk first, so a crash before the others know it leaves them untouched;
+    // its inode table comes from disk 0, which is empty with a metadata tier
+    memcpy(ptr, ref, sb.d_blocks_ptr);
+    memset((char*)ptr + sb.d_bitmap_ptr, 0, sb.i_blocks_ptr - sb.d_bitmap_ptr);
+    memcpy(&other, &sb, sizeof(struct wfs_sb));
+    strcpy(other.id, sb.disks[n]);
+    if (sb.flags & WFS_F_CHECKSUM) {
+        long itable = (sb.d_blocks_ptr - sb.i_blocks_ptr) / BLOCK_SIZE;
+        off_t ref_csums = ((struct wfs_sb*)ref)->c_blocks_ptr;
+        other.c_blocks_ptr = sb.d_blocks_ptr + blocks * BLOCK_SIZE;
+        memcpy((char*)ptr + other.c_blocks_ptr, (char*)ref + ref_csums, itable * sizeof(uint32_t));
+        memset((char*)ptr + other.c_blocks_ptr + itable * sizeof(uint32_t), 0, blocks * sizeof(uint32_t));
+    }
+    memcpy(ptr, &other, sizeof(struct wfs_sb));
+    for (int i = 0; i < n + meta_disks; i++) {
+        memcpy(&other, disk_ptrs[i], sizeof(struct wfs_sb));
+        other.num_disks = n + 1;
+        strcpy(other.disks[n], sb.disks[n]);
+        memcpy((char*)&other + offsetof(struct wfs_sb, free_inodes), (char*)&sb + offsetof(struct wfs_sb, free_inodes), len);
+        memcpy(disk_ptrs[i], &other, sizeof(struct wfs_sb));
+    }
+
+    // the metadata images move up one to stay after the data disks
+    disk_ptrs = realloc(disk_ptrs, (n + 1 + meta_disks) * sizeof(void*));
+    disk_sizes = realloc(disk_sizes, (n + 1 + meta_disks) * sizeof(size_t));
+    disk_fds = realloc(disk_fds, (n + 1 + meta_disks) * sizeof(int));
+    memmove(disk_ptrs + n + 1, disk_ptrs + n, meta_disks * sizeof(void*));
+    memmove(disk_sizes + n + 1, disk_sizes + n, meta_disks * sizeof(size_t));
+    memmove(disk_fds + n + 1, disk_fds + n, meta_disks * sizeof(int));
+    disk_ptrs[n] = ptr;
+    disk_sizes[n] = st.st_size;
+    disk_fds[n] = fd;
+    maindisk = disk_ptrs[meta_disks > 0 ? n + 1 : 0];
+    // block numbers now run up to num_data_blocks per disk of the new layout
+    nblocks = sb.num_data_blocks * (n + 1);
+    if (block_refs != NULL) {
+        block_refs = realloc(block_refs, nblocks * sizeof(int));
+        memset(block_refs + sb.num_data_blocks * n, 0, sb.num_data_blocks * sizeof(int));
+    }
+    if (dedup.indexed != NULL) {
+        dedup.next = realloc(dedup.next, nblocks * sizeof(int));
+        dedup.hash = realloc(dedup.hash, nblocks * sizeof(uint32_t));
+        dedup.indexed = realloc(dedup.indexed, nblocks);
+        memset(dedup.indexed + sb.num_data_blocks * n, 0, sb.num_data_blocks);
+    }
+    total_disks = n + 1;
+    restripe.from = n;
+    restripe.pos = 0;
+    restripe.end = (long)n * sb.num_data_blocks;
+    restripe.moved = 0;
+    restripe_start();
+    return 0;
+}
+
+int restripe_status(char *buf, size_t size) {
+    return snprintf(buf, size, "state: %s\ndisks: %d\nposition: %ld/%ld\nmoved: %ld\n",
+                    restripe.from != 0 ? (restripe.paused ? "paused" : "running") : restripe.end > 0 ? "done" : "off",
+                    restripe.from == 0 ? total_disks : restripe.from, restripe.from == 0 ? restripe.end : restripe.pos,
+                    restripe.end, restripe.moved);
+}
+
+int scrub_status(char *buf, size_t size) {
+    return snprintf(buf, size,
+                    "state: %s\nrate: %ld\npasses: %ld\nposition: %ld/%ld\n"
+                    "checked: %ld\nmismatches: %ld\nrepaired: %ld\nunrepairable: %ld\n",
+                    !scrub.running ? "off" : scrub.paused ? "paused" : "running",
+                    scrub.rate, scrub.passes, scrub.position, scrub.total,
+                    scrub.checked, scrub.mismatches, scrub.repaired, scrub.unrepairable);
+}
+
+// commands written to RESTRIPE_PATH: "add <image>", "pause", "resume" or "rate <blocks/s>"
+int restripe_control(const char *buf, size_t size) {
+    char cmd[PATH_MAX + 16];
+    long rate;
+    int rc;
+
+    snprintf(cmd, sizeof(cmd), "%.*s", (int)min(size, sizeof(cmd) - 1), buf);
+    cmd[strcspn(cmd, "\n")] = '\0';
+    if (strncmp(cmd, "add ", 4) == 0) {
+        if ((rc = restripe_add(cmd + 4)) < 0) {
+            return rc;
+        }
+    }
+    else if (strcmp(cmd, "pause") == 0) {
+        restripe.paused = 1;
+    }
+    else if (strcmp(cmd, "resume") == 0) {
+        restripe.paused = 0;
+    }
+    else if (sscanf(cmd, "rate %ld", &rate) == 1 && rate > 0) {
+        restripe.rate = rate;
+    }
+    else {
+        return -EINVAL;
+    }
+    return size;
+}
+
+// commands written to SCRUB_PATH: "pause", "resume" or "rate <units/s>"
+int scrub_control(const char *buf, size_t size) {
+    char cmd[64];
+    long rate;
+
+    snprintf(cmd, sizeof(cmd), "%.*s", (int)min(size, sizeof(cmd) - 1), buf);
+    if (strncmp(cmd, "pause", 5) == 0) {
+        scrub.paused = 1;
+    }
+    else if (strncmp(cmd, "resume", 6) == 0) {
+        scrub.paused = 0;
+    }
+    else if (sscanf(cmd, "rate %ld", &rate) == 1 && rate > 0) {
+        scrub.rate = rate;
+    }
+    else {
+        return -EINVAL;
+    }
+    return size;
+}
+
+/*
+  Control files. SCRUB_PATH and RESTRIPE_PATH are not in any directory;
+  every operation checks for their paths first. Reading one returns the
+  current status and writing one runs a command. Anyone may read the
+  scrub status, but writes, and any use of RESTRIPE_PATH, are for the
+  user who mounted wfs and root.
+*/
+int ctl_file(const char *path) {
+    return strcmp(path, SCRUB_PATH) == 0 || strcmp(path, RESTRIPE_PATH) == 0;
+}
+
+// 0 if uid may open the control file path, for writing if write is set
+int ctl_access(const char *path, int write, uid_t uid) {
+    if (uid == 0 || uid == getuid() || (strcmp(path, SCRUB_PATH) == 0 && !write)) {
+        return 0;
+    }
+    return -EACCES;
+}
+
+int ctl_status(const char *path, char *buf, size_t size) {
+    if (strcmp(path, RESTRIPE_PATH) == 0) {
+        return restripe_status(buf, size);
+    }
+    return scrub_status(buf, size);
+}
+
+void ctl_stat(const char *path, struct stat *stbuf) {
+    char status[512];
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | (strcmp(path, RESTRIPE_PATH) == 0 ? 0600 : 0644);
+    stbuf->st_size = ctl_status(path, status, sizeof(status));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+}
+
+// [offset, offset + size) of the status of control file path
+int ctl_read(const char *path, char *buf, size_t size, off_t offset) {
+    char status[512];
+    int len = ctl_status(path, status, sizeof(status));
+
+    if (offset >= len) {
+        return 0;
+    }
+    memcpy(buf, status + offset, min(size, len - offset));
+    return min(size, len - offset);
+}
+
+int ctl_write(const char *path, const char *buf, size_t size) {
+    if (strcmp(path, RESTRIPE_PATH) == 0) {
+        return restripe_control(buf, size);
+    }
+    return scrub_control(buf, size);
+}
+
+/*
+  Write-back (--writeback). A small write that continues where the last
+  one to the same file ended is appended to a per-inode buffer instead of
+  going to the disks. The whole run is written later by one write_blocks
+  call: one path walk, one inode update, and one round of allocation and
+  mirroring. Buffers are flushed on flush, fsync and release, before the
+  file is read, and whenever their slot is needed for another inode.
+  WB_SLOTS bounds the memory used to a fixed WB_SLOTS * WB_SIZE bytes.
+  A failed flush keeps whatever was not written in the buffer and is
+  reported by the flush, fsync, release or write that triggered it.
+*/
+#define WB_SLOTS 8
+#define WB_SIZE (N_BLOCKS * BLOCK_SIZE)
+
+struct wb_buffer {
+    int inum;
+    long used;          // LRU stamp, 0 while the slot is free
+    char *path;
+    off_t start;
+    size_t len;
+    char data[WB_SIZE];
+};
+struct wb_buffer wb[WB_SLOTS];
+long wb_tick;
+int writeback;
+
+struct wb_buffer* wb_lookup(int inum) {
+    for (int i = 0; i < WB_SLOTS; i++) {
+        if (wb[i].used != 0 && wb[i].inum == inum) {
+            return &wb[i];
+        }
+    }
+    return NULL;
+}
+
+struct wb_buffer* wb_lookup_path(const char *path) {
+    for (int i = 0; i < WB_SLOTS; i++) {
+        if (wb[i].used != 0 && strcmp(wb[i].path, path) == 0) {
+            return &wb[i];
+        }
+    }
+    return NULL;
+}
+
+void wb_drop(struct wb_buffer *b) {
+    if (b != NULL && b->used != 0) {
+        free(b->path);
+        b->used = 0;
+    }
+}
+
+// write a buffer out and release its slot; returns 0 or a negative errno,
+// in which case the slot keeps the bytes that did not reach the disks
+int wb_flush(struct wb_buffer *b) {
+    int rc;
+
+    if (b == NULL || b->used == 0) {
+        return 0;
+    }
+    rc = write_blocks(b->inum, b->data, NULL, b->len, b->start);
+    if (rc < 0) {
+        return rc;
+    }
+    if (rc < b->len) {
+        memmove(b->data, b->data + rc, b->len - rc);
+        b->start += rc;
+        b->len -= rc;
+        return -ENOSPC;
+    }
+    wb_drop(b);
+    return 0;
+}
+
+// returns 0 or the last error, with the failed buffers still held
+int wb_flush_all() {
+    int rc = 0, err;
+
+    for (int i = 0; i < WB_SLOTS; i++) {
+        if ((err = wb_flush(&wb[i])) < 0) {
+            rc = err;
+        }
+    }
+    return rc;
+}
+
+// buffer a write that could not be appended to an existing run
+int wb_write(const char *path, int inum, const char *buf, size_t size, off_t offset) {
+    struct wb_buffer *b;
+    struct wfs_inode inode;
+    int rc;
+
+    if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+        return rc;
+    }
+    inode = fetch_inode(inum);
+    // large or out of range writes go straight through
+    if (!S_ISREG(inode.mode) || size >= WB_SIZE || offset + size > WB_SIZE) {
+        return write_blocks(inum, buf, NULL, size, offset);
+    }
+
+    b = &wb[0];
+    for (int i = 0; i < WB_SLOTS; i++) {
+        if (wb[i].used == 0) {
+            b = &wb[i];
+            break;
+        }
+        if (wb[i].used < b->used) {
+            b = &wb[i];
+        }
+    }
+    // out of slots: the oldest run goes to disk now, and stays if it cannot
+    if ((rc = wb_flush(b)) < 0) {
+        return rc;
+    }
+    b->inum = inum;
+    b->path = strdup(path);
+    b->start = offset;
+    b->len = size;
+    b->used = ++wb_tick;
+    memcpy(b->data, buf, size);
+    return size;
+}
+
+// recount block references and index file blocks from the inode table
+void block_refs_init() {
+    void *disk_ptr = maindisk;
+    struct wfs_sb sb;
+    struct wfs_inode inode;
+    long nblocks;
+    int dnum;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if ((sb.flags & (WFS_F_DEDUP | WFS_F_SNAPSHOT)) == 0 || block_refs != NULL) {
+        return;
+    }
+    nblocks = sb.num_data_blocks * total_disks;
+    block_refs = calloc(nblocks, sizeof(int));
+    if (sb.flags & WFS_F_DEDUP) {
+        for (dedup.nbuckets = 1; dedup.nbuckets < nblocks; dedup.nbuckets <<= 1);
+        dedup.next = calloc(nblocks, sizeof(int));
+        dedup.hash = calloc(nblocks, sizeof(uint32_t));
+        dedup.indexed = calloc(nblocks, 1);
+        dedup.heads = malloc(dedup.nbuckets * sizeof(int));
+        memset(dedup.heads, -1, dedup.nbuckets * sizeof(int));
+    }
+
+    for (long i = 0; i < sb.num_inodes; i++) {
+        if (!bit_set((off_t)disk_ptr + sb.i_bitmap_ptr, i)) {
+            continue;
+        }
+        memcpy(&inode, (void*)inode_ptr(i), sizeof(struct wfs_inode));
+        for (int k = 0; k < N_BLOCKS; k++) {
+            if ((dnum = inode.blocks[k]) == -1 || dnum >= META_BASE) {
+                continue;
+            }
+            block_refs[dnum]++;
+            if (dedup.heads != NULL && S_ISREG(inode.mode) && !dedup.indexed[dnum] &&
+                ((inode.mode & WFS_S_COMPRESSED) || (k + 1) * BLOCK_SIZE <= inode.size)) {
+                dedup_index(dnum, crc32c((void*)fetch_block(dnum), BLOCK_SIZE));
+            }
+        }
+        // pointer blocks and leaves of a tree directory; its root is blocks[IND_BLOCK]
+        if ((inode.mode & WFS_S_DIRTREE) && meta_disks == 0) {
+            int tree[DIR_FANOUT + 1];
+            int ntree = dir_tree_blocks(&inode, tree);
+            for (int t = 1; t < ntree; t++) {
+                block_refs[tree[t]]++;
+            }
+            for (long n = IND_BLOCK; (dnum = dir_next(&inode, &n)) != -1; n++) {
+                block_refs[dnum]++;
+            }
+        }
+    }
+}
+
+/*
+  Snapshots. `mkdir /.snapshots/<name>` copies every inode reachable from
+  the root, and every directory block, into a new tree under
+  /.snapshots. File data blocks are shared through block_refs, so the
+  cost is proportional to the metadata only. The live tree and the
+  snapshot copy a shared block before changing it (unshare_block).
+  Snapshots are read-only; `rmdir /.snapshots/<name>` deletes one.
+*/
+#define SNAP_NAME ".snapshots"
+#define SNAP_PATH "/" SNAP_NAME
+
+int in_snapshot(const char *path) {
+    return strncmp(path, SNAP_PATH "/", strlen(SNAP_PATH "/")) == 0;
+}
+
+// the snapshot directory itself is never part of a snapshot
+int snapshot_skip(int inum, struct wfs_dentry *dentry) {
+    return dentry->num == -1 || (inum == 0 && strncmp(dentry->name, SNAP_NAME, MAX_NAME) == 0);
+}
+
+// inodes and directory blocks a snapshot of the tree under inum needs
+void snapshot_count(int inum, long *ninodes, long *nblocks) {
+    struct wfs_inode inode;
+    struct wfs_dentry entries[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+    int tree[DIR_FANOUT + 1];
+    int blk;
+
+    memcpy(&inode, (void*)inode_ptr(inum), sizeof(struct wfs_inode));
+    (*ninodes)++;
+    if (!S_ISDIR(inode.mode)) {
+        return;
+    }
+    *nblocks += dir_tree_blocks(&inode, tree);
+    for (long n = 0; (blk = dir_next(&inode, &n)) != -1; n++) {
+        (*nblocks)++;
+        memcpy(entries, (void*)fetch_block(blk), BLOCK_SIZE);
+        for (int d = 0; d < dentries; d++) {
+            if (!snapshot_skip(inum, &entries[d])) {
+                snapshot_count(entries[d].num, ninodes, nblocks);
+            }
+        }
+    }
+}
+
+// copy the tree under inum, sharing file blocks; returns the copy's inum
+int snapshot_copy(int inum) {
+    void *disk_ptr = maindisk;
+    struct wfs_sb sb;
+    struct wfs_inode inode;
+    struct wfs_inode src = { .mode = 0 };
+    struct wfs_dentry entries[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+    unsigned char slot[BLOCK_SIZE];
+    int copy, dnum, blk;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    memcpy(slot, (void*)inode_ptr(inum), inode_slot_size(sb));
+    memcpy(&inode, slot, sizeof(struct wfs_inode));
+    copy = alloc_inode(inode.mode)->num;
+    inode.num = copy;
+    inode.mode |= WFS_S_SNAPSHOT;
+
+    if (S_ISREG(inode.mode)) {
+        for (int i = 0; i < N_BLOCKS; i++) {
+            if (inode.blocks[i] != -1) {
+                block_refs[inode.blocks[i]]++;
+            }
+        }
+    }
+    else {
+        // rebuilt slot by slot, growing its own tree if the source has one
+        memcpy(&src, slot, sizeof(struct wfs_inode));
+        memset(inode.blocks, -1, sizeof(inode.blocks));
+        inode.mode &= ~WFS_S_DIRTREE;
+    }
+    for (long n = 0; S_ISDIR(src.mode) && (blk = dir_next(&src, &n)) != -1; n++) {
+        memcpy(entries, (void*)fetch_block(blk), BLOCK_SIZE);
+        for (int d = 0; d < dentries; d++) {
+            if (snapshot_skip(inum, &entries[d])) {
+                entries[d].num = -1;
+            }
+            else {
+                entries[d].num = snapshot_copy(entries[d].num);
+            }
+        }
+        dnum = alloc_dirblock();
+        memcpy_v(fetch_block(dnum), entries, BLOCK_SIZE, 0);
+        dir_set_block(&inode, n, dnum);
+    }
+    // whole slot, so inline data comes along
+    memcpy(slot, &inode, sizeof(struct wfs_inode));
+    memcpy_v(inode_ptr(copy), slot, inode_slot_size(sb), 1);
+    return copy;
+}
+
+// add a dentry for c_inum to directory p_inum
+int add_dentry(int p_inum, const char *name, int c_inum) {
+    struct wfs_dentry *block_ptr;
+    struct wfs_inode p_inode;
+    struct dir_index *idx;
+    long slot;
+    struct wfs_dentry new_dentry = {
+        .num = c_inum
+    };
+
+    if ((block_ptr = fetch_available_block(p_inum, &slot)) == 0) {
+        return -1;
+    }
+    strncpy(new_dentry.name, name, MAX_NAME - 1);
+    memcpy_v((off_t)block_ptr, &new_dentry, sizeof(struct wfs_dentry), 0);
+    p_inode = fetch_inode(p_inum);
+    // an index built after this point reads the entry from disk
+    if ((idx = dir_index_cached(p_inum)) != NULL) {
+        dir_index_add(idx, new_dentry.name, slot, block_ptr - dir_dentry(&p_inode, slot, 0));
+    }
+    p_inode.mtim = time(NULL);
+    memcpy_v(inode_ptr(p_inode.num), &p_inode, sizeof(struct wfs_inode), 1);
+    return 0;
+}
+
+int snapshot_create(const char *name) {
+    void *disk_ptr = maindisk;
+    struct wfs_sb sb;
+    long ninodes = 0, nblocks = 0;
+    int snapdir, copy, flags, rc;
+    char path[sizeof(SNAP_PATH) + MAX_NAME + 1];
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if (name == NULL || strlen(name) == 0 || strlen(name) >= MAX_NAME) {
+        return -EINVAL;
+    }
+    if ((rc = wb_flush_all()) < 0) {
+        return rc;
+    }
+    snprintf(path, sizeof(path), "%s/%s", SNAP_PATH, name);
+    if (validatepath(path) != -1) {
+        return -EEXIST;
+    }
+
+    // check for room up front, so a snapshot is never left half made;
+    // the slack covers /.snapshots and new dentry blocks
+    snapshot_count(0, &ninodes, &nblocks);
+    if (ninodes + 1 > (long)sb.free_inodes || nblocks + 3 > (meta_disks > 0 ? meta_free() : (long)sb.free_blocks)) {
+        return -ENOSPC;
+    }
+    if ((snapdir = validatepath(SNAP_PATH)) == -1) {
+        snapdir = alloc_inode(S_IFDIR | 0755)->num;
+        if (add_dentry(0, SNAP_NAME, snapdir) == -1) {
+            free_inode(snapdir);
+            return -ENOSPC;
+        }
+    }
+
+    // blocks become shareable from now on; every disk records it
+    if ((sb.flags & WFS_F_SNAPSHOT) == 0) {
+        flags = sb.flags | WFS_F_SNAPSHOT;
+        for (int i = 0; i < total_disks + meta_disks; i++) {
+            memcpy((char*)disk_ptrs[i] + offsetof(struct wfs_sb, flags), &flags, sizeof(int));
+        }
+        block_refs_init();
+    }
+
+    copy = snapshot_copy(0);
+    if (add_dentry(snapdir, name, copy) == -1) {
+        free_tree(copy);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+int snapshot_delete(const char *path) {
+    int inum, snapdir;
+
+    if ((inum = validatepath(path)) == -1 || (snapdir = validatepath(SNAP_PATH)) == -1) {
+        return -ENOENT;
+    }
+    if (free_dentry(snapdir, inum, getname(path)) != 1) {
+        return -ENOENT;
+    }
+    free_tree(inum);
+    return 0;
+}
+
+/*
+  Readahead. Every open file remembers where its last read ended. A read
+  that starts there counts as sequential and doubles a window of upcoming
+  blocks, from RA_MIN up to RA_MAX, which are advised with MADV_WILLNEED
+  on the disks holding them, so their page faults are already in flight
+  when the next read arrives. Any other read resets the window.
+*/
+#define RA_MIN 2
+#define RA_MAX N_BLOCKS
+
+struct ra_state {
+    off_t next;
+    int window;
+};
+
+// advise the mapped pages behind blocks [first, first + count) of a file
+void prefetch_blocks(struct wfs_inode inode, int first, int count) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t b_ptr, start = 0, end = 0;
+
+    for (int blk = first; blk < first + count && blk < N_BLOCKS; blk++) {
+        if (inode.blocks[blk] == -1) {
+            continue;
+        }
+        b_ptr = fetch_block(inode.blocks[blk]);
+        // coalesce blocks that follow each other on the same disk
+        if (b_ptr != end) {
+            if (end > start) {
+                madvise((void*)start, end - start, MADV_WILLNEED);
+            }
+            start = b_ptr & ~(page - 1);
+        }
+        end = b_ptr + BLOCK_SIZE;
+    }
+    if (end > start) {
+        madvise((void*)start, end - start, MADV_WILLNEED);
+    }
+}
+
+void readahead_file(int inum, struct ra_state *ra, off_t offset, size_t size) {
+    void *disk_ptr = maindisk;
+    struct wfs_sb sb;
+    struct wfs_inode inode;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if (offset != ra->next) {
+        ra->window = 0;
+        ra->next = offset + size;
+        return;
+    }
+    ra->window = ra->window == 0 ? RA_MIN : min(ra->window * 2, RA_MAX);
+    ra->next = offset + size;
+
+    memcpy(&inode, (void*)inode_ptr(inum), sizeof(struct wfs_inode));
+    if (isinline(inode, sb) || (inode.mode & WFS_S_COMPRESSED) || ra->next >= inode.size) {
+        return;
+    }
+    prefetch_blocks(inode, roundup(ra->next, BLOCK_SIZE) / BLOCK_SIZE, ra->window);
+}
+
+// attributes of inum as both frontends report them; st_ino is inum + 1
+void fill_stat(int inum, struct stat *stbuf) {
+    struct wfs_inode inode;
+    struct wb_buffer *b;
+    struct timespec tim;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    inode = fetch_inode(inum);
+    printf("[DEBUG] fetching inode %d\n", inode.num);
+    stbuf->st_ino = inum + 1;
+    stbuf->st_uid = inode.uid;
+    stbuf->st_gid = inode.gid;
+    stbuf->st_mode = inode.mode & ~(WFS_S_COMPRESSED | WFS_S_DIRTREE | WFS_S_SNAPSHOT);
+    stbuf->st_size = inode.size;
+    if ((b = wb_lookup(inum)) != NULL && b->start + b->len > inode.size) {
+        stbuf->st_size = b->start + b->len;
+    }
+    // allocated space in 512-byte units, so holes do not count
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (inode.blocks[i] != -1) {
+            stbuf->st_blocks += BLOCK_SIZE / 512;
+        }
+    }
+    tim.tv_sec = inode.atim;
+    stbuf->st_atim = tim;
+    tim.tv_sec = inode.mtim;
+    stbuf->st_mtim = tim;
+    printf("[DEBUG] populated stbuf %d\n", inode.num);
+    printf("[DEBUG] size %ld\n", stbuf->st_size);
+    printf("[DEBUG] mode %d\n", stbuf->st_mode);
+    printf("[DEBUG] uid %d\n", stbuf->st_uid);
+    printf("[DEBUG] gid %d\n", stbuf->st_gid);
+}
+
+static int wfs_getattr(const char *path, struct stat *stbuf) {
+    printf("\n******* inside getattr *******\n");
+    FS_LOCK();
+    int inum;
+
+    printf("[DEBUG] path %s\n", path);
+    if (ctl_file(path)) {
+        ctl_stat(path, stbuf);
+        return 0;
+    }
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    fill_stat(inum, stbuf);
+    return 0;
+}
+
+static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+    printf("\n******* inside mknod *******\n");
+    FS_LOCK();
+    int p_inum;
+    int existing_inum;
+    void *curr_disk = maindisk;
+    const char *name;
+    const char *parentpath;
+    struct wfs_sb sb;
+    struct wfs_inode *new_inode;
+    struct wfs_inode existing_inode;
+    mode_t file_mode = mode | S_IFREG;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+    name = getname(path);
+    parentpath = getparentpath(path);
+
+    memcpy(&sb, curr_disk, sizeof(struct wfs_sb));
+    if ((p_inum = validatepath(parentpath)) == -1) {
+        return -ENOENT;
+    }
+    if ((existing_inum = data_exists(name, p_inum)) != -1) {
+        existing_inode = fetch_inode(existing_inum);
+        if (S_ISREG(existing_inode.mode))
+            return -EEXIST;
+    }
+    if ((new_inode = alloc_inode(file_mode)) == 0) {
+        printf("[DEBUG] no more space for file inode\n");
+        return -ENOSPC;
+    };
+    if (add_dentry(p_inum, name, new_inode->num) == -1) {
+        printf("[DEBUG] no more space for file datablock\n");
+        return -ENOSPC;
+    }
+    printf("[DEBUG] successfully created new file\n");
     return 0;
 }
 
 static int wfs_mkdir(const char *path, mode_t mode) {
     printf("\n******* inside mkdir *******\n");
+    FS_LOCK();
     int p_inum;
     int existing_inum;
     void *curr_disk = maindisk;
@@ -832,183 +3736,1238 @@ static int wfs_mkdir(const char *path, mode_t mode) {
     const char *parentpath;
     struct wfs_sb sb;
     struct wfs_inode *new_inode;
-    struct wfs_inode p_inode;
     struct wfs_inode existing_inode;
-    struct wfs_dentry *block_ptr;
-    off_t i_blocks_ptr;
     mode_t dir_mode = mode | S_IFDIR;
 
     if (path == NULL || strlen(path) == 0) {
         return -ENOENT;
     }
-    name = getname(path);
-    parentpath = getparentpath(path);
+    name = getname(path);
+    parentpath = getparentpath(path);
+    if (strcmp(parentpath, SNAP_PATH) == 0) {
+        return snapshot_create(name);
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+
+    memcpy(&sb, curr_disk, sizeof(struct wfs_sb));
+    if ((p_inum = validatepath(parentpath)) == -1) {
+        return -ENOENT;
+    }
+    if ((existing_inum = data_exists(name, p_inum)) != -1) {
+        existing_inode = fetch_inode(existing_inum);
+        if (S_ISDIR(existing_inode.mode))
+            return -EEXIST;
+    }
+    if ((new_inode = alloc_inode(dir_mode)) == 0) {
+        printf("[DEBUG] no more space for dir inode\n");
+        return -ENOSPC;
+    };
+    if (add_dentry(p_inum, name, new_inode->num) == -1) {
+        printf("[DEBUG] no more space for dir datablock\n");
+        return -ENOSPC;
+    }
+    printf("[DEBUG] successfully created new directory\n");
+    return 0;
+}
+
+static int wfs_unlink(const char *path) {
+    printf("\n******* inside unlink *******\n");
+    FS_LOCK();
+    int inum, p_inum;
+    struct wfs_inode inode;
+    const char *name;
+    const char *parentpath;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+    name = getname(path);
+    parentpath = getparentpath(path);
+
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    inode = fetch_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+        return -ENOENT;
+    }
+    p_inum = validatepath(parentpath);
+    wb_drop(wb_lookup(inum));
+    if (free_file(inum, p_inum, name) != 1) {
+        return -ENOENT;
+    }
+    printf("[DEBUG] successfully removed file\n");
+    return 0;
+}
+
+static int wfs_rmdir(const char *path) {
+    printf("\n******* inside rmdir *******\n");
+    FS_LOCK();
+    int inum, p_inum;
+    struct wfs_inode inode;
+    const char *name;
+    const char *parentpath;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    name = getname(path);
+    parentpath = getparentpath(path);
+    if (strcmp(parentpath, SNAP_PATH) == 0) {
+        return snapshot_delete(path);
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    inode = fetch_inode(inum);
+    if (!S_ISDIR(inode.mode)) {
+        return -ENOENT;
+    }
+    if (!isdirempty(inum)) {
+        return -ENOTEMPTY;
+    }
+    p_inum = validatepath(parentpath);
+    if (free_dir(inum, p_inum, name) != 1) {
+        return -ENOENT;
+    }
+    printf("[DEBUG] successfully removed directory\n");
+    return 0;
+}
+
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    printf("\n******* inside read *******\n");
+    FS_LOCK();
+    int inum;
+    int bytes_read;
+    int rc;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    if (ctl_file(path)) {
+        return ctl_read(path, buf, size, offset);
+    }
+
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+        return rc;
+    }
+    if ((bytes_read = read_blocks(inum, buf, size, offset)) < 0) {
+        return bytes_read;
+    }
+    if (fi != NULL && fi->fh != 0) {
+        readahead_file(inum, (struct ra_state*)(uintptr_t)fi->fh, offset, bytes_read);
+    }
+
+    printf("[DEBUG] successfully read file (%d)\n", bytes_read);
+    return bytes_read;
+}
+
+static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    printf("\n******* inside write *******\n");
+    FS_LOCK();
+    int inum;
+    int bytes_written;
+    struct wb_buffer *b;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    if (ctl_file(path)) {
+        return ctl_write(path, buf, size);
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+    // appends to a buffered run skip the path walk and the inode entirely
+    if (writeback && (b = wb_lookup_path(path)) != NULL &&
+        offset == b->start + b->len && offset + size <= WB_SIZE) {
+        memcpy(b->data + b->len, buf, size);
+        b->len += size;
+        b->used = ++wb_tick;
+        return size;
+    }
+
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    if (writeback) {
+        bytes_written = wb_write(path, inum, buf, size, offset);
+    }
+    else {
+        bytes_written = write_blocks(inum, buf, NULL, size, offset);
+    }
+    if (bytes_written < 0) {
+        return bytes_written;
+    }
+
+    printf("[DEBUG] successfully wrote file (%d)\n", bytes_written);
+    return bytes_written;
+}
+
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info* fi) {
+    printf("\n******* inside write_buf *******\n");
+    size_t size = fuse_buf_size(buf);
+    char *data;
+    ssize_t n;
+    int inum;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    // one memory buffer is exactly what write takes
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return wfs_write(path, buf->buf[0].mem, size, offset, fi);
+    }
+    if (!writeback && !ctl_file(path) && !in_snapshot(path)) {
+        FS_LOCK();
+        if ((inum = validatepath(path)) == -1) {
+            return -ENOENT;
+        }
+        return write_blocks(inum, NULL, buf, size, offset);
+    }
+
+    // write-back buffers and control files need the data in memory
+    if ((n = gather_buf(buf, &data)) < 0) {
+        return n;
+    }
+    n = wfs_write(path, data, n, offset, fi);
+    free(data);
+    return n;
+}
+
+static int wfs_truncate(const char *path, off_t size) {
+    printf("\n******* inside truncate *******\n");
+    FS_LOCK();
+    int inum;
+    int rc;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    // shell redirections truncate the control file before writing to it
+    if (ctl_file(path)) {
+        return ctl_access(path, 1, fuse_get_context()->uid);
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+        return rc;
+    }
+    return truncate_file(inum, size);
+}
+
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info* fi) {
+    printf("\n******* inside ftruncate *******\n");
+    return wfs_truncate(path, size);
+}
+
+static int wfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+    printf("\n******* inside fallocate *******\n");
+    FS_LOCK();
+    int inum;
+    int rc;
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    if (in_snapshot(path)) {
+        return -EROFS;
+    }
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+        return rc;
+    }
+    return fallocate_file(inum, mode, offset, length);
+}
+
+static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+    printf("\n******* inside readdir *******\n");
+    FS_LOCK();
+    int inum;
+    /*const char *parentpath;*/
+
+    if (path == NULL || strlen(path) == 0) {
+        return -ENOENT;
+    }
+    /*parentpath = getparentpath(path);*/
+
+    if ((inum = validatepath(path)) == -1) {
+        return -ENOENT;
+    }
+    if (read_dentries(inum, buf, filler, offset) != 1) {
+        printf("[DEBUG] failed to read dentries\n");
+        return -ENOENT;
+    }
+
+    printf("[DEBUG] succesfully read directory entries\n");
+    return 0;
+}
+
+static int wfs_statfs(const char *path, struct statvfs *stbuf) {
+    printf("\n******* inside statfs *******\n");
+    FS_LOCK();
+    struct wfs_sb sb;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = sb.disk_blocks[0];
+    for (int i = 1; raid == RAID_0 && i < total_disks; i++) {
+        stbuf->f_blocks += sb.disk_blocks[i];
+    }
+    stbuf->f_bfree = sb.free_blocks;
+    stbuf->f_bavail = sb.free_blocks;
+    stbuf->f_files = sb.num_inodes;
+    stbuf->f_ffree = sb.free_inodes;
+    stbuf->f_favail = sb.free_inodes;
+    stbuf->f_namemax = MAX_NAME - 1;
+    return 0;
+}
+
+static void* wfs_init(struct fuse_conn_info *conn) {
+    // started here rather than in main so the thread survives daemonizing
+    if (scrub.rate > 0 && pthread_create(&scrub.thread, NULL, scrub_thread, NULL) == 0) {
+        scrub.running = 1;
+    }
+    if (restripe.from != 0) {
+        restripe_start();
+    }
+    // one large request instead of a stream of page sized ones
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+    conn->max_write = WFS_MAX_WRITE;
+    // low-level read replies can be spliced from the image files, and
+    // write_buf requests read from the pipe they arrive in
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+    return NULL;
+}
+
+static void wfs_destroy(void *private_data) {
+    if (scrub.running) {
+        scrub.stop = 1;
+        pthread_join(scrub.thread, NULL);
+        scrub.running = 0;
+    }
+    if (restripe.running) {
+        restripe.stop = 1;
+        pthread_join(restripe.thread, NULL);
+        restripe.running = 0;
+    }
+    if (wb_flush_all() < 0) {
+        for (int i = 0; i < WB_SLOTS; i++) {
+            if (wb[i].used != 0) {
+                fprintf(stderr, "wfs: lost %ld buffered bytes of %s\n", wb[i].len, wb[i].path);
+            }
+        }
+    }
+}
+
+int keep_cache;
+
+static int wfs_open(const char *path, struct fuse_file_info* fi) {
+    printf("\n******* inside open *******\n");
+    FS_LOCK();
+    struct ra_state *ra;
+    int rc;
+
+    if (ctl_file(path) && (rc = ctl_access(path, (fi->flags & O_ACCMODE) != O_RDONLY, fuse_get_context()->uid)) < 0) {
+        return rc;
+    }
+    // readahead state lives as long as the file handle
+    if ((ra = calloc(1, sizeof(struct ra_state))) != NULL) {
+        fi->fh = (uintptr_t)ra;
+    }
+    // all writes pass through the kernel, so its cached pages stay valid;
+    // the control files change behind its back
+    fi->keep_cache = keep_cache && !ctl_file(path);
+    return 0;
+}
+
+static int wfs_flush(const char *path, struct fuse_file_info* fi) {
+    printf("\n******* inside flush *******\n");
+    FS_LOCK();
+
+    return wb_flush(wb_lookup_path(path));
+}
+
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info* fi) {
+    printf("\n******* inside fsync *******\n");
+    FS_LOCK();
+
+    return wb_flush(wb_lookup_path(path));
+}
+
+static int wfs_release(const char *path, struct fuse_file_info* fi) {
+    printf("\n******* inside release *******\n");
+    FS_LOCK();
+
+    free((void*)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    return wb_flush(wb_lookup_path(path));
+}
+
+static struct fuse_operations ops = {
+  .getattr = wfs_getattr,
+  .mknod   = wfs_mknod,
+  .mkdir   = wfs_mkdir,
+  .unlink  = wfs_unlink,
+  .rmdir   = wfs_rmdir,
+  .open    = wfs_open,
+  .read    = wfs_read,
+  .write   = wfs_write,
+  .write_buf = wfs_write_buf,
+  .statfs  = wfs_statfs,
+  .truncate = wfs_truncate,
+  .ftruncate = wfs_ftruncate,
+  .fallocate = wfs_fallocate,
+  .flush   = wfs_flush,
+  .fsync   = wfs_fsync,
+  .release = wfs_release,
+  .readdir = wfs_readdir,
+  .init    = wfs_init,
+  .destroy = wfs_destroy,
+};
+
+/*
+  Low-level frontend (--lowlevel). Requests name inodes instead of paths:
+  the FUSE inode number is the wfs inode number plus one, so the root is
+  FUSE_ROOT_ID. lookup resolves one name in one directory and replies
+  with entry_timeout and attr_timeout, letting the kernel dcache and
+  attribute cache answer repeated lookups and stats. With --keep-cache
+  open keeps the page cache across opens. libfuse 2.9 has no readdirplus;
+  readdir entries carry inode numbers and types instead.
+
+  Reads, writes, truncates and the other per-file operations go straight
+  to the inode. Creating and removing names, write-back buffers and
+  the control files still go through the path operations, with the path rebuilt
+  from ll_nodes: the parent and name every inode was last looked up
+  under. wfs has no hard links, so that pair is unique.
+*/
+struct ll_node {
+    int parent;
+    char name[MAX_NAME];
+};
+
+int lowlevel;
+double entry_timeout = 1.0;
+double attr_timeout = 1.0;
+struct ll_node *ll_nodes;
+int scrub_inum;             // the inode numbers the control files are reported under
+int restripe_inum;
+
+void ll_remember(int inum, int parent, const char *name) {
+    ll_nodes[inum].parent = parent;
+    strncpy(ll_nodes[inum].name, name, MAX_NAME - 1);
+}
+
+// path of the control file inum stands for, or NULL for a real inode
+const char* ll_ctl(int inum) {
+    if (inum == scrub_inum) {
+        return SCRUB_PATH;
+    }
+    if (inum == restripe_inum) {
+        return RESTRIPE_PATH;
+    }
+    return NULL;
+}
+
+// inum is a control file or an allocated inode, so it is safe to fetch
+int ll_valid(int inum) {
+    void *disk_ptr = maindisk;
+    struct wfs_sb sb;
+
+    memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
+    if (ll_ctl(inum) != NULL) {
+        return 1;
+    }
+    return inum >= 0 && inum < sb.num_inodes && bit_set((off_t)disk_ptr + sb.i_bitmap_ptr, inum);
+}
+
+// snapshot inodes carry their own read-only mark, whatever path reached them
+int ll_snapshot(int inum) {
+    return (((struct wfs_inode*)inode_ptr(inum))->mode & WFS_S_SNAPSHOT) != 0;
+}
+
+// path of inum, or of name in directory inum; NULL if inum was never looked up
+char* ll_path(int inum, const char *name) {
+    FS_LOCK();
+    char *path, *tmp;
+
+    if (asprintf(&path, "%s%s", name != NULL ? "/" : "", name != NULL ? name : "") < 0) {
+        return NULL;
+    }
+    for (; inum != 0; inum = ll_nodes[inum].parent) {
+        if (ll_nodes[inum].parent == -1 || asprintf(&tmp, "/%s%s", ll_nodes[inum].name, path) < 0) {
+            free(path);
+            return NULL;
+        }
+        free(path);
+        path = tmp;
+    }
+    if (path[0] == '\0') {
+        free(path);
+        return strdup("/");
+    }
+    return path;
+}
+
+void ll_stat(int inum, struct stat *stbuf) {
+    if (ll_ctl(inum) == NULL) {
+        fill_stat(inum, stbuf);
+        return;
+    }
+    ctl_stat(ll_ctl(inum), stbuf);
+    stbuf->st_ino = inum + 1;
+}
+
+// a negative entry for inum -1, so the kernel caches the miss as well
+void ll_reply_entry(fuse_req_t req, int inum) {
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.entry_timeout = entry_timeout;
+    e.attr_timeout = attr_timeout;
+    if (inum != -1) {
+        e.ino = inum + 1;
+        ll_stat(inum, &e.attr);
+    }
+    fuse_reply_entry(req, &e);
+}
+
+void ll_reply_err(fuse_req_t req, int rc) {
+    fuse_reply_err(req, rc < 0 ? -rc : 0);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    printf("\n******* inside ll_lookup *******\n");
+    FS_LOCK();
+    struct wfs_inode inode;
+    int p_inum = parent - 1;
+    int inum;
+
+    if (p_inum == 0 && strcmp(name, SCRUB_PATH + 1) == 0) {
+        ll_reply_entry(req, scrub_inum);
+        return;
+    }
+    if (p_inum == 0 && strcmp(name, RESTRIPE_PATH + 1) == 0) {
+        ll_reply_entry(req, restripe_inum);
+        return;
+    }
+    if (!ll_valid(p_inum)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    inode = fetch_inode(p_inum);
+    if (!S_ISDIR(inode.mode)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((inum = dir_lookup(&inode, name)) != -1) {
+        ll_remember(inum, p_inum, name);
+    }
+    ll_reply_entry(req, inum);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    printf("\n******* inside ll_getattr *******\n");
+    FS_LOCK();
+    struct stat st;
+
+    if (!ll_valid(ino - 1)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    ll_stat(ino - 1, &st);
+    fuse_reply_attr(req, &st, attr_timeout);
+}
+
+int ll_setattr_inode(int inum, struct stat *attr, int to_set) {
+    FS_LOCK();
+    struct wfs_inode inode;
+    int rc;
+
+    if (!ll_valid(inum)) {
+        return -ESTALE;
+    }
+    if (ll_ctl(inum) != NULL) {
+        return 0;
+    }
+    if (ll_snapshot(inum)) {
+        return -EROFS;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+            return rc;
+        }
+        if ((rc = truncate_file(inum, attr->st_size)) < 0) {
+            return rc;
+        }
+    }
+    // truncating opens set the times along with the size
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        inode = fetch_inode(inum);
+        if (to_set & FUSE_SET_ATTR_ATIME) {
+            inode.atim = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL) : attr->st_atime;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME) {
+            inode.mtim = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+        }
+        memcpy_v(inode_ptr(inum), &inode, sizeof(struct wfs_inode), 1);
+    }
+    return 0;
+}
+
+// sizes and times only: there is no chmod or chown
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    printf("\n******* inside ll_setattr *******\n");
+    int rc;
+
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    // shell redirections truncate the control file before writing to it
+    if (ll_ctl(ino - 1) != NULL && (to_set & FUSE_SET_ATTR_SIZE) &&
+        (rc = ctl_access(ll_ctl(ino - 1), 1, fuse_req_ctx(req)->uid)) < 0) {
+        ll_reply_err(req, rc);
+        return;
+    }
+    if ((rc = ll_setattr_inode(ino - 1, attr, to_set)) < 0) {
+        ll_reply_err(req, rc);
+        return;
+    }
+    ll_getattr(req, ino, fi);
+}
+
+// reply with the entry of a name the path operation just created
+void ll_created(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FS_LOCK();
+    int inum;
+
+    if ((inum = data_exists(name, parent - 1)) == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    ll_remember(inum, parent - 1, name);
+    ll_reply_entry(req, inum);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    char *path;
+    int rc;
+
+    if ((path = ll_path(parent - 1, name)) == NULL) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    rc = wfs_mknod(path, mode, rdev);
+    free(path);
+    if (rc < 0) {
+        ll_reply_err(req, rc);
+        return;
+    }
+    ll_created(req, parent, name);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    char *path;
+    int rc;
+
+    if ((path = ll_path(parent - 1, name)) == NULL) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    rc = wfs_mkdir(path, mode);
+    free(path);
+    if (rc < 0) {
+        ll_reply_err(req, rc);
+        return;
+    }
+    ll_created(req, parent, name);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char *path;
+
+    if ((path = ll_path(parent - 1, name)) == NULL) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    ll_reply_err(req, wfs_unlink(path));
+    free(path);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char *path;
+
+    if ((path = ll_path(parent - 1, name)) == NULL) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    ll_reply_err(req, wfs_rmdir(path));
+    free(path);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    printf("\n******* inside ll_open *******\n");
+    FS_LOCK();
+    struct ra_state *ra;
+    int rc;
+
+    if (!ll_valid(ino - 1)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    if (ll_ctl(ino - 1) != NULL &&
+        (rc = ctl_access(ll_ctl(ino - 1), (fi->flags & O_ACCMODE) != O_RDONLY, fuse_req_ctx(req)->uid)) < 0) {
+        ll_reply_err(req, rc);
+        return;
+    }
+    if ((ra = calloc(1, sizeof(struct ra_state))) != NULL) {
+        fi->fh = (uintptr_t)ra;
+    }
+    fi->keep_cache = keep_cache && ll_ctl(ino - 1) == NULL;
+    fuse_reply_open(req, fi);
+}
+
+// bufvec for a read of an inode; called with fs_lock held, which the
+// caller keeps until the fd entries have been spliced
+int ll_read_buf(int inum, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec *bv;
+    int rc;
+
+    if (!ll_valid(inum)) {
+        return -ESTALE;
+    }
+    if (ll_ctl(inum) == NULL) {
+        if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+            return rc;
+        }
+        if ((rc = map_read(inum, bufp, size, offset)) <= 0) {
+            if (rc == 0 && fi->fh != 0) {
+                readahead_file(inum, (struct ra_state*)(uintptr_t)fi->fh, offset, fuse_buf_size(*bufp));
+            }
+            return rc;
+        }
+    }
 
-    memcpy(&sb, curr_disk, sizeof(struct wfs_sb));
-    i_blocks_ptr = (off_t)curr_disk + sb.i_blocks_ptr;
-    if ((p_inum = validatepath(parentpath)) == -1) {
-        return -ENOENT;
+    // nothing to refer to: read into a buffer
+    bv = malloc(sizeof(struct fuse_bufvec));
+    *bv = FUSE_BUFVEC_INIT(size);
+    bv->buf[0].mem = malloc(size);
+    if (ll_ctl(inum) != NULL) {
+        rc = ctl_read(ll_ctl(inum), bv->buf[0].mem, size, offset);
     }
-    if ((existing_inum = data_exists(name, p_inum)) != -1) {
-        existing_inode = fetch_inode(existing_inum);
-        if (S_ISDIR(existing_inode.mode))
-            return -EEXIST;
+    else {
+        rc = read_blocks(inum, bv->buf[0].mem, size, offset);
     }
-    if ((new_inode = alloc_inode(dir_mode)) == 0) {
-        printf("[DEBUG] no more space for dir inode\n");
-        return -ENOSPC;
-    };
-    if ((block_ptr = fetch_available_block(p_inum)) == 0) {
-        printf("[DEBUG] no more space for dir datablock\n");
-        return -ENOSPC;
+    if (rc < 0) {
+        free(bv->buf[0].mem);
+        free(bv);
+        return rc;
     }
-    struct wfs_dentry new_dentry = {
-        .num = new_inode->num
-    };
-    strcpy(new_dentry.name, name);
-    memcpy_v((off_t)block_ptr, &new_dentry, sizeof(struct wfs_dentry), 0);
-    p_inode = fetch_inode(p_inum);
-    /*p_inode.size += sizeof(new_dentry);*/
-    p_inode.mtim = time(NULL);
-    /*p_inode.nlinks++;*/
-    memcpy_v((i_blocks_ptr + (p_inode.num * BLOCK_SIZE)), &p_inode, sizeof(struct wfs_inode), 1);
-    printf("[DEBUG] successfully created new directory\n");
+    bv->buf[0].size = rc;
+    *bufp = bv;
     return 0;
 }
 
-static int wfs_unlink(const char *path) {
-    printf("\n******* inside unlink *******\n");
-    int inum, p_inum;
-    struct wfs_inode inode;
-    const char *name;
-    const char *parentpath;
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    printf("\n******* inside ll_read *******\n");
+    FS_LOCK();
+    struct fuse_bufvec *bv;
+    int rc;
 
-    if (path == NULL || strlen(path) == 0) {
-        return -ENOENT;
+    if ((rc = ll_read_buf(ino - 1, &bv, size, off, fi)) < 0) {
+        ll_reply_err(req, rc);
+        return;
     }
-    name = getname(path);
-    parentpath = getparentpath(path);
+    fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+    for (size_t i = 0; i < bv->count; i++) {
+        free(bv->buf[i].mem);
+    }
+    free(bv);
+}
 
-    if ((inum = validatepath(path)) == -1) {
-        return -ENOENT;
+int ll_write_inode(int inum, struct fuse_bufvec *buf, off_t offset) {
+    FS_LOCK();
+    size_t size = fuse_buf_size(buf);
+
+    if (!ll_valid(inum)) {
+        return -ESTALE;
     }
-    inode = fetch_inode(inum);
-    if (!S_ISREG(inode.mode)) {
-        return -ENOENT;
+    if (ll_snapshot(inum)) {
+        return -EROFS;
     }
-    p_inum = validatepath(parentpath);
-    if (free_file(inum, p_inum, name) != 1) {
-        return -ENOENT;
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return write_blocks(inum, buf->buf[0].mem, NULL, size, offset);
     }
-    printf("[DEBUG] successfully removed file\n");
-    return 0;
+    return write_blocks(inum, NULL, buf, size, offset);
 }
 
-static int wfs_rmdir(const char *path) {
-    printf("\n******* inside rmdir *******\n");
-    int inum, p_inum;
-    struct wfs_inode inode;
-    const char *name;
-    const char *parentpath;
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+    printf("\n******* inside ll_write_buf *******\n");
+    char *path;
+    int rc;
 
-    if (path == NULL || strlen(path) == 0) {
-        return -ENOENT;
+    if (!writeback && ll_ctl(ino - 1) == NULL) {
+        rc = ll_write_inode(ino - 1, buf, off);
     }
-    name = getname(path);
-    parentpath = getparentpath(path);
+    // write-back buffers remember the path they belong to
+    else if ((path = ll_path(ino - 1, NULL)) == NULL) {
+        rc = -ESTALE;
+    }
+    else {
+        rc = wfs_write_buf(path, buf, off, fi);
+        free(path);
+    }
+    if (rc < 0) {
+        ll_reply_err(req, rc);
+        return;
+    }
+    fuse_reply_write(req, rc);
+}
 
-    if ((inum = validatepath(path)) == -1) {
-        return -ENOENT;
+int ll_flush_inode(int inum) {
+    FS_LOCK();
+
+    // unlink dropped the buffers of a removed inode; closing it still succeeds
+    if (!ll_valid(inum)) {
+        return 0;
     }
-    inode = fetch_inode(inum);
-    if (!S_ISDIR(inode.mode)) {
+    return wb_flush(wb_lookup(inum));
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    ll_reply_err(req, ll_flush_inode(ino - 1));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    ll_reply_err(req, ll_flush_inode(ino - 1));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    free((void*)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    ll_reply_err(req, ll_flush_inode(ino - 1));
+}
+
+int ll_fallocate_inode(int inum, int mode, off_t offset, off_t length) {
+    FS_LOCK();
+    int rc;
+
+    if (!ll_valid(inum)) {
+        return -ESTALE;
+    }
+    // control files have no inode, and no dentry for wfs_fallocate to find
+    if (ll_ctl(inum) != NULL) {
         return -ENOENT;
     }
-    if (!isdirempty(inum)) {
-        return -ENOTEMPTY;
+    if (ll_snapshot(inum)) {
+        return -EROFS;
     }
-    p_inum = validatepath(parentpath);
-    if (free_dir(inum, p_inum, name) != 1) {
-        return -ENOENT;
+    if ((rc = wb_flush(wb_lookup(inum))) < 0) {
+        return rc;
     }
-    printf("[DEBUG] successfully removed directory\n");
+    return fallocate_file(inum, mode, offset, length);
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    ll_reply_err(req, ll_fallocate_inode(ino - 1, mode, offset, length));
+}
+
+struct ll_dirbuf {
+    fuse_req_t req;
+    fuse_ino_t ino;
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+// fuse_fill_dir_t for read_dentries that packs entries into a readdir reply
+int ll_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    struct ll_dirbuf *db = buf;
+    struct stat st;
+    size_t len;
+
+    memset(&st, 0, sizeof(struct stat));
+    if (stbuf != NULL) {
+        st = *stbuf;
+    }
+    else {
+        st.st_ino = strcmp(name, ".") == 0 ? db->ino : ll_nodes[db->ino - 1].parent + 1;
+        st.st_mode = S_IFDIR;
+    }
+    len = fuse_add_direntry(db->req, db->buf + db->len, db->size - db->len, name, &st, off);
+    if (len > db->size - db->len) {
+        return 1;
+    }
+    db->len += len;
     return 0;
 }
 
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    printf("\n******* inside read *******\n");
-    int inum;
-    size_t bytes_read;
+int ll_readdir_inode(struct ll_dirbuf *db, off_t offset) {
+    FS_LOCK();
+    struct wfs_inode inode;
 
-    if (path == NULL || strlen(path) == 0) {
-        return -ENOENT;
+    if (!ll_valid(db->ino - 1)) {
+        return -ESTALE;
+    }
+    inode = fetch_inode(db->ino - 1);
+    if (!S_ISDIR(inode.mode)) {
+        return -ENOTDIR;
     }
+    read_dentries(db->ino - 1, (char*)db, ll_fill, offset);
+    return 0;
+}
 
-    if ((inum = validatepath(path)) == -1) {
-        return -ENOENT;
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    printf("\n******* inside ll_readdir *******\n");
+    struct ll_dirbuf db = { .req = req, .ino = ino, .buf = malloc(size), .size = size };
+    int rc;
+
+    if ((rc = ll_readdir_inode(&db, off)) < 0) {
+        ll_reply_err(req, rc);
     }
-    if ((bytes_read = read_blocks(inum, buf, size, offset)) == 0) {
-        return -ENOENT;
+    else {
+        fuse_reply_buf(req, db.buf, db.len);
     }
+    free(db.buf);
+}
 
-    printf("[DEBUG] successfully read file (%zu)\n", bytes_read);
-    return bytes_read;
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs st;
+
+    wfs_statfs("/", &st);
+    fuse_reply_statfs(req, &st);
 }
 
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    printf("\n******* inside write *******\n");
-    int inum;
-    size_t bytes_written;
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+    wfs_init(conn);
+}
 
-    if (path == NULL || strlen(path) == 0) {
-        return -ENOENT;
+static void ll_destroy(void *userdata) {
+    wfs_destroy(userdata);
+}
+
+static struct fuse_lowlevel_ops ll_ops = {
+  .init    = ll_init,
+  .destroy = ll_destroy,
+  .lookup  = ll_lookup,
+  .forget  = ll_forget,
+  .getattr = ll_getattr,
+  .setattr = ll_setattr,
+  .mknod   = ll_mknod,
+  .mkdir   = ll_mkdir,
+  .unlink  = ll_unlink,
+  .rmdir   = ll_rmdir,
+  .open    = ll_open,
+  .read    = ll_read,
+  .write_buf = ll_write_buf,
+  .flush   = ll_flush,
+  .release = ll_release,
+  .fsync   = ll_fsync,
+  .readdir = ll_readdir,
+  .statfs  = ll_statfs,
+  .fallocate = ll_fallocate,
+};
+
+// fuse_main for the low-level frontend
+int ll_main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    struct wfs_sb sb;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    memcpy(&sb, maindisk, sizeof(struct wfs_sb));
+    scrub_inum = sb.num_inodes;
+    restripe_inum = sb.num_inodes + 1;
+    ll_nodes = calloc(sb.num_inodes + 2, sizeof(struct ll_node));
+    for (int i = 1; i < sb.num_inodes; i++) {
+        ll_nodes[i].parent = -1;
     }
+    ll_remember(scrub_inum, 0, SCRUB_PATH + 1);
+    ll_remember(restripe_inum, 0, RESTRIPE_PATH + 1);
 
-    if ((inum = validatepath(path)) == -1) {
-        return -ENOENT;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        if ((se = fuse_lowlevel_new(&args, &ll_ops, sizeof(ll_ops), NULL)) != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
     }
-    if ((bytes_written = write_blocks(inum, buf, size, offset)) == 0) {
-        return -ENOENT;
+    fuse_opt_free_args(&args);
+    free(ll_nodes);
+    return err ? 1 : 0;
+}
+
+// write len bytes of src to fd at off, one large sequential transfer
+int pwrite_all(int fd, const void *src, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = pwrite(fd, src, len, off)) <= 0) {
+            return -1;
+        }
+        src = (const char*)src + n;
+        len -= n;
+        off += n;
     }
+    return 0;
+}
 
-    printf("[DEBUG] successfully wrote file (%zu)\n", bytes_written);
-    return bytes_written;
+// copy [from, to) of ref to fd one window at a time, dropping each from ref
+int rebuild_window(int fd, void *ref, off_t from, off_t to) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t end, start;
+
+    for (; from < to; from = end) {
+        end = (from / MAP_WINDOW + 1) * MAP_WINDOW < to ? (from / MAP_WINDOW + 1) * MAP_WINDOW : to;
+        if (pwrite_all(fd, (void*)((off_t)ref + from), end - from, from) < 0) {
+            return -1;
+        }
+        start = from & ~(page - 1);
+        madvise((char*)ref + start, end - start, MADV_DONTNEED);
+    }
+    return 0;
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    printf("\n******* inside readdir *******\n");
-    int inum;
-    /*const char *parentpath;*/
+/*
+  Copies the runs of set bits in bitmap (nbits long) from the table at
+  ref + start, `unit` bytes per bit, to fd. Consecutive allocations are
+  coalesced into a single pwrite, widened to whole blocks so per-block
+  checksums stay valid. Returns the units copied, -1 on error. Rebuild
+  runs before the window table exists, so with --mem-budget a run is
+  written a window at a time and each window of ref is dropped after it.
+*/
+long rebuild_runs(int fd, void *ref, off_t start, off_t bitmap, long nbits, size_t unit, long done, long total) {
+    long i = 0, run, copied = 0;
+    off_t from, to;
 
-    if (path == NULL || strlen(path) == 0) {
-        return -ENOENT;
+    while (i < nbits) {
+        if (!bit_set(bitmap, i)) {
+            i++;
+            continue;
+        }
+        for (run = i; run < nbits && bit_set(bitmap, run); run++);
+        from = start + (i * unit) / BLOCK_SIZE * BLOCK_SIZE;
+        to = start + (run * unit + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (maps.budget > 0) {
+            if (rebuild_window(fd, ref, from, to) < 0) {
+                return -1;
+            }
+        }
+        else if (pwrite_all(fd, (void*)((off_t)ref + from), to - from, from) < 0) {
+            return -1;
+        }
+        copied += run - i;
+        i = run;
+        fprintf(stderr, "\rrebuild: %ld/%ld (%ld%%)", done + copied, total, (done + copied) * 100 / total);
     }
-    /*parentpath = getparentpath(path);*/
+    return copied;
+}
 
-    if ((inum = validatepath(path)) == -1) {
-        return -ENOENT;
+/*
+  Brings a blank replacement disk into the array under the disk ID that is
+  missing from the other images. Only the superblock, bitmaps, allocated
+  inodes and allocated data blocks are copied from a surviving mirror, so
+  the time taken follows used space rather than image size. A lost
+  metadata image is rebuilt the same way from another one, whatever the
+  RAID mode of the data disks.
+*/
+int rebuild_disk(int blank, int fd, int dcnt) {
+    struct wfs_sb sb, other;
+    void *ref = NULL;
+    int missing = -1, meta;
+    char *id;
+    long ninodes = 0, nblocks = 0, nbits, total, done, copied;
+    off_t end;
+
+    for (int i = 0; i < dcnt && ref == NULL; i++) {
+        if (i != blank) {
+            ref = disk_ptrs[i];
+        }
     }
-    if (read_dentries(inum, buf, filler) != 1) {
-        printf("[DEBUG] failed to read dentries\n");
-        return -ENOENT;
+    memcpy(&sb, ref, sizeof(struct wfs_sb));
+    for (int k = 0; k < sb.num_disks + sb.num_meta; k++) {
+        int found = 0;
+        id = k < sb.num_disks ? sb.disks[k] : sb.metas[k - sb.num_disks];
+        for (int i = 0; i < dcnt; i++) {
+            memcpy(&other, disk_ptrs[i], sizeof(struct wfs_sb));
+            if (i != blank && strcmp(other.id, id) == 0) {
+                found = 1;
+            }
+        }
+        if (!found) {
+            if (missing != -1) {
+                fprintf(stderr, "rebuild: more than one disk is missing\n");
+                return -1;
+            }
+            missing = k;
+        }
+    }
+    if (missing == -1) {
+        fprintf(stderr, "rebuild: no disk ID is missing\n");
+        return -1;
+    }
+    meta = missing >= sb.num_disks;
+    if (raid == RAID_0 && !meta) {
+        fprintf(stderr, "rebuild: RAID0 data has no second copy\n");
+        return -1;
+    }
+    // a surviving image of the same kind
+    ref = NULL;
+    for (int i = 0; i < dcnt && ref == NULL; i++) {
+        memcpy(&other, disk_ptrs[i], sizeof(struct wfs_sb));
+        if (i != blank && ismeta(other) == meta) {
+            ref = disk_ptrs[i];
+        }
+    }
+    if (ref == NULL) {
+        fprintf(stderr, "rebuild: no copy of the missing disk is left\n");
+        return -1;
+    }
+    memcpy(&sb, ref, sizeof(struct wfs_sb));
+    id = meta ? sb.metas[missing - sb.num_disks] : sb.disks[missing];
+    nbits = meta ? sb.meta_blocks : sb.num_data_blocks;
+    end = (sb.flags & WFS_F_CHECKSUM) ? sb.c_blocks_ptr + (off_t)((sb.d_blocks_ptr - sb.i_blocks_ptr) / BLOCK_SIZE + nbits) * sizeof(uint32_t)
+                                      : sb.d_blocks_ptr + (off_t)nbits * BLOCK_SIZE;
+    if (disk_sizes[blank] < end) {
+        fprintf(stderr, "rebuild: replacement disk is too small (%zu < %ld)\n", disk_sizes[blank], end);
+        return -1;
     }
 
-    printf("[DEBUG] succesfully read directory entries\n");
+    for (long i = 0; i < sb.num_inodes; i++) {
+        ninodes += bit_set((off_t)ref + sb.i_bitmap_ptr, i);
+    }
+    for (long i = 0; i < nbits; i++) {
+        nblocks += bit_set((off_t)ref + sb.d_bitmap_ptr, i);
+    }
+    total = ninodes + nblocks;
+    if (total == 0) {
+        total = 1;
+    }
+
+    // bitmaps and everything before the inode table in one go
+    if (pwrite_all(fd, (void*)((off_t)ref + sb.i_bitmap_ptr), sb.i_blocks_ptr - sb.i_bitmap_ptr, sb.i_bitmap_ptr) < 0) {
+        return -1;
+    }
+    done = 0;
+    if ((copied = rebuild_runs(fd, ref, sb.i_blocks_ptr, (off_t)ref + sb.i_bitmap_ptr, sb.num_inodes, inode_slot_size(sb), done, total)) < 0) {
+        return -1;
+    }
+    done += copied;
+    if ((copied = rebuild_runs(fd, ref, sb.d_blocks_ptr, (off_t)ref + sb.d_bitmap_ptr, nbits, BLOCK_SIZE, done, total)) < 0) {
+        return -1;
+    }
+    done += copied;
+    if ((sb.flags & WFS_F_CHECKSUM) &&
+        pwrite_all(fd, (void*)((off_t)ref + sb.c_blocks_ptr), end - sb.c_blocks_ptr, sb.c_blocks_ptr) < 0) {
+        return -1;
+    }
+
+    // superblock last, so an interrupted rebuild leaves the disk blank
+    strcpy(sb.id, id);
+    if (pwrite_all(fd, &sb, sizeof(struct wfs_sb), 0) < 0 || fsync(fd) < 0) {
+        return -1;
+    }
+    fprintf(stderr, "\rrebuild: %ld/%ld (100%%), disk %d restored as %s\n", done, total, blank, sb.id);
     return 0;
 }
 
-static struct fuse_operations ops = {
-  .getattr = wfs_getattr,
-  .mknod   = wfs_mknod,
-  .mkdir   = wfs_mkdir,
-  .unlink  = wfs_unlink,
-  .rmdir   = wfs_rmdir,
-  .read    = wfs_read,
-  .write   = wfs_write,
-  .readdir = wfs_readdir,
-};
+int rebuild;
+
+// wfs options mixed in with the FUSE options; returns 1 if arg was consumed
+int parse_wfs_option(const char *arg) {
+    if (strncmp(arg, "--scrub-rate=", 13) == 0) {
+        scrub.rate = strtol(arg + 13, NULL, 10);
+        return 1;
+    }
+    if (strcmp(arg, "--rebuild") == 0) {
+        rebuild = 1;
+        return 1;
+    }
+    if (strncmp(arg, "--mem-budget=", 13) == 0) {
+        maps.budget = parse_size(arg + 13);
+        return 1;
+    }
+    if (strncmp(arg, "--data-advice=", 14) == 0) {
+        if (strcmp(arg + 14, "sequential") == 0) maps.advice = MADV_SEQUENTIAL;
+        else if (strcmp(arg + 14, "normal") == 0) maps.advice = MADV_NORMAL;
+        else maps.advice = MADV_RANDOM;
+        return 1;
+    }
+    if (strcmp(arg, "--writeback") == 0) {
+        writeback = 1;
+        return 1;
+    }
+    if (strcmp(arg, "--compress") == 0) {
+        compress = 1;
+        return 1;
+    }
+    if (strcmp(arg, "--discard") == 0) {
+        discard = 1;
+        return 1;
+    }
+    if (strcmp(arg, "--lowlevel") == 0) {
+        lowlevel = 1;
+        return 1;
+    }
+    if (strncmp(arg, "--entry-timeout=", 16) == 0) {
+        entry_timeout = strtod(arg + 16, NULL);
+        return 1;
+    }
+    if (strncmp(arg, "--attr-timeout=", 15) == 0) {
+        attr_timeout = strtod(arg + 15, NULL);
+        return 1;
+    }
+    if (strcmp(arg, "--keep-cache") == 0) {
+        keep_cache = 1;
+        return 1;
+    }
+    if (strncmp(arg, "--restripe-rate=", 16) == 0) {
+        restripe.rate = strtol(arg + 16, NULL, 10);
+        return 1;
+    }
+    return 0;
+}
 
-// ./wfs disk1 disk2 [FUSE options] mount_point
+// ./wfs disk1 disk2 [--scrub-rate=N] [--rebuild] [--compress] [--writeback] [--discard]
+//       [--mem-budget=SIZE] [--data-advice=random|sequential|normal] [--keep-cache]
+//       [--lowlevel [--entry-timeout=SEC] [--attr-timeout=SEC]] [--restripe-rate=N] [FUSE options] mount_point
+// RAID0 grows while mounted: echo "add /abs/path/disk3" > mnt/.restripe, then list disk3 last from then on
+// metadata images made with mkfs -m are listed along with the disks, in any position
 int main(int argc, char *argv[]) {
     if (argc <= 2) {
         return -1;
@@ -1041,12 +5000,29 @@ int main(int argc, char *argv[]) {
     }
     char **fuse_argv = malloc(fuse_argc * sizeof(char*));
 
+    int j = 0;
     while (i < argc) {
-        fuse_argv[i-dcnt-1] = malloc(strlen(argv[i]) + 1);
-        strcpy(fuse_argv[i-dcnt-1], argv[i]);
+        if (parse_wfs_option(argv[i])) {
+            fuse_argc--;
+            i++;
+            continue;
+        }
+        fuse_argv[j] = malloc(strlen(argv[i]) + 1);
+        strcpy(fuse_argv[j], argv[i]);
+        j++;
         i++;
     }
+    if (fuse_argc == 0) {
+        freev((void*)disks, ndisks, 1);
+        freev((void*)fuse_argv, fuse_argc, 1);
+        return -1;
+    }
 
+    int blank = -1;
+    int blank_fd = -1;
+    disk_ptrs = malloc(dcnt * sizeof(void*));
+    disk_sizes = malloc(dcnt * sizeof(size_t));
+    disk_fds = malloc(dcnt * sizeof(int));
     for (i = 0; i < dcnt; i++) {
         int fd = open(disks[i], O_RDWR);
         if (fd < 0) {
@@ -1060,35 +5036,84 @@ int main(int argc, char *argv[]) {
             freev((void*)fuse_argv, fuse_argc, 1);
             return -1;
         }
+        disk_ptrs[i] = disk_ptr;
+        struct stat st;
+        fstat(fd, &st);
+        disk_sizes[i] = st.st_size;
+
         memcpy(&sb, disk_ptr, sizeof(struct wfs_sb));
         if (!validatedisk(sb)) {
-            close(fd);
+            // with --rebuild one blank replacement disk may stand in for a lost one
+            if (!rebuild || blank != -1) {
+                close(fd);
+                freev((void*)disks, ndisks, 1);
+                freev((void*)fuse_argv, fuse_argc, 1);
+                return -1;
+            }
+            blank = i;
+            blank_fd = fd;
+            continue;
+        }
+        if (total_disks == 0) {
+            total_disks = sb.num_disks;
+            meta_disks = sb.num_meta;
+            raid = sb.raid;
+        }
+        // kept for zero-copy reads, and for discard to punch holes through
+        disk_fds[i] = fd;
+    }
+    if (dcnt != total_disks + meta_disks) {
+        freev((void*)disks, ndisks, 1);
+        freev((void*)fuse_argv, fuse_argc, 1);
+        return -1;
+    }
+    if (blank != -1) {
+        if (rebuild_disk(blank, blank_fd, dcnt) != 0) {
+            close(blank_fd);
             freev((void*)disks, ndisks, 1);
             freev((void*)fuse_argv, fuse_argc, 1);
             return -1;
         }
-        if (i == 0) {
-            total_disks = sb.num_disks;
-            raid = sb.raid;
-            disk_ptrs = malloc(total_disks * sizeof(void*));
-            disk_sizes = malloc(total_disks * sizeof(size_t));
-            if (dcnt != total_disks) {
-                close(fd);
+        disk_fds[blank] = blank_fd;
+    }
+    // metadata images may be listed anywhere; they go after the data disks
+    if (meta_disks > 0) {
+        void *ptrs[dcnt];
+        size_t sizes[dcnt];
+        int fds[dcnt];
+        int k = 0;
+        for (int meta = 0; meta < 2; meta++) {
+            for (i = 0; i < dcnt; i++) {
+                memcpy(&sb, disk_ptrs[i], sizeof(struct wfs_sb));
+                if (ismeta(sb) == meta) {
+                    ptrs[k] = disk_ptrs[i];
+                    sizes[k] = disk_sizes[i];
+                    fds[k++] = disk_fds[i];
+                }
+            }
+            if (meta == 0 && k != total_disks) {
                 freev((void*)disks, ndisks, 1);
                 freev((void*)fuse_argv, fuse_argc, 1);
                 return -1;
             }
         }
-        disk_ptrs[i] = disk_ptr;
-        struct stat st;
-        fstat(fd, &st);
-        disk_sizes[i] = st.st_size;
-
-        close(fd);
+        memcpy(disk_ptrs, ptrs, sizeof(ptrs));
+        memcpy(disk_sizes, sizes, sizeof(sizes));
+        memcpy(disk_fds, fds, sizeof(fds));
+    }
+    // set main disk, the first metadata image if there are any
+    maindisk = disk_ptrs[meta_disks > 0 ? total_disks : 0];
+    restripe_load();
+    crc32c_init();
+    block_refs_init();
+    map_init();
+    if (discard) {
+        discard_free();
     }
-    // set main disk
-    maindisk = disk_ptrs[0];
 
     umask(0);
+    if (lowlevel) {
+        return ll_main(fuse_argc, fuse_argv);
+    }
     return fuse_main(fuse_argc, fuse_argv, &ops, NULL);
 }
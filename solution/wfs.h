@@ -3,6 +3,7 @@
 
 #define MIN_DISKS 2
 #define MAX_DISKS 16
+#define MAX_META 4
 #define BLOCK_SIZE (512)
 #define MAX_NAME   (28)
 #define DISK_ID_SIZE (128)
@@ -11,6 +12,24 @@
 #define IND_BLOCK  (D_BLOCK+1)
 #define N_BLOCKS   (IND_BLOCK+1)
 
+// Feature flags (wfs_sb.flags), selected with `mkfs -f`
+#define WFS_F_INLINE  (1 << 0)  /* small regular files live in their inode slot */
+#define WFS_F_COMPACT (1 << 1)  /* inode table packs sizeof(wfs_inode) records */
+#define WFS_F_CHECKSUM (1 << 2) /* CRC32C per inode table and data block */
+#define WFS_F_DEDUP   (1 << 3)  /* identical file blocks are shared between inodes */
+#define WFS_F_SNAPSHOT (1 << 4) /* set by wfs once a snapshot shares blocks */
+
+// Inode mode bits outside S_IFMT and the permissions, never reported to users
+#define WFS_S_COMPRESSED (01000000) /* data blocks hold one compressed stream */
+#define WFS_S_DIRTREE    (02000000) /* blocks[IND_BLOCK] roots a tree of dentry blocks */
+#define WFS_S_SNAPSHOT   (04000000) /* part of a read-only snapshot, atime included */
+
+// block numbers per pointer block of a directory tree
+#define DIR_FANOUT (BLOCK_SIZE / sizeof(int))
+
+// dentry block n of a metadata tier has block number META_BASE + n
+#define META_BASE (1 << 30)
+
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image. 
@@ -24,6 +43,59 @@
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  Each inode owns a BLOCK_SIZE slot in INODES. With WFS_F_INLINE, regular
+  files smaller than the rest of the slot keep their data right after the
+  inode and have no data blocks. With WFS_F_COMPACT the slots shrink to
+  sizeof(struct wfs_inode) and INODES is rounded up to a whole block.
+
+  With WFS_F_CHECKSUM a CSUMS region follows DATA BLOCKS at c_blocks_ptr.
+  It holds one uint32_t CRC32C per block of INODES, then one per data
+  block, covering the blocks of the disk it lives on. A stored 0 means
+  the block has never been written through wfs and is not verified.
+
+  free_inodes and free_blocks count clear bits in the bitmaps, and
+  disk_free_blocks[i] those of disk i's data bitmap (RAID0 gives each
+  disk its own; mirrors are identical). mkfs sets them, wfs keeps them
+  current on every disk and fsck.wfs recounts them.
+
+  In RAID0 the disks may differ in size. Disk i holds disk_blocks[i]
+  data blocks and num_data_blocks is the largest of them; every disk
+  keeps a num_data_blocks bit data bitmap, and bits past its own count
+  are never used. Each disk's CSUMS region follows its own data blocks,
+  so c_blocks_ptr differs between disks. New blocks are striped in
+  proportion to disk_weights[i]. Mirrored disks all hold num_data_blocks.
+
+  A RAID0 data block number dnum lives on disk dnum % n at offset
+  dnum / n, where n is num_disks. While wfs restripes onto an added disk,
+  restripe_from is the old disk count and blocks at or past restripe_pos
+  still use n = restripe_from; 0 means no restripe is running.
+
+  With a metadata tier (mkfs -m) the num_meta images named in metas[]
+  are mirrored among themselves and hold the superblock of record, the
+  inode bitmap, the inode table and every dentry block. They use the
+  same layout, except that their DBITMAP and DATA BLOCKS track and hold
+  meta_blocks dentry blocks, numbered from META_BASE. The data disks
+  then only hold file data: their IBITMAP and INODES stay empty and the
+  free space counters in their superblocks are not kept current.
+
+  A directory keeps its dentry blocks in blocks[0..IND_BLOCK) and, until
+  it needs more, blocks[IND_BLOCK]. Past that it gets WFS_S_DIRTREE and
+  blocks[IND_BLOCK] points at an index block of DIR_FANOUT int block
+  numbers, each -1 or a pointer block of DIR_FANOUT dentry block numbers.
+  The block that was in blocks[IND_BLOCK] becomes the tree's first leaf.
+
+  A -1 in blocks[] below a file's size is a hole that reads as zeros.
+
+  A regular file with WFS_S_COMPRESSED in its mode stores its whole
+  contents as one LZ4-style stream in blocks[0..n): a uint32_t stream
+  length followed by the compressed bytes. inode.size stays the logical
+  size. Files that do not shrink by at least a block are stored raw.
+
+  With WFS_F_DEDUP or WFS_F_SNAPSHOT one data block may appear in several
+  inodes' blocks[]. Reference counts are not stored; wfs recounts them at
+  mount. Snapshots are ordinary directory trees under /.snapshots whose
+  inodes carry WFS_S_SNAPSHOT.
+
 */
 
 // RAID Modes
@@ -45,6 +117,18 @@ struct wfs_sb {
     char id[DISK_ID_SIZE];
     char disks[MAX_DISKS][DISK_ID_SIZE];
     size_t num_disks;
+    int flags;
+    off_t c_blocks_ptr;
+    size_t free_inodes;
+    size_t free_blocks;
+    size_t disk_free_blocks[MAX_DISKS];
+    size_t disk_blocks[MAX_DISKS];
+    int disk_weights[MAX_DISKS];
+    size_t restripe_from;
+    size_t restripe_pos;
+    size_t num_meta;
+    size_t meta_blocks;
+    char metas[MAX_META][DISK_ID_SIZE];
 };
 
 // Inode
@@ -402,6 +402,58 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 		      testlist))
 		 raidconfigs)))
 
+(defun feature-mount-cmd (numdisks opts dir)
+  "Mount wfs like mount-cmd, passing wfs options before the FUSE ones.
+
+NUMDISKS the number of disks used for testing
+OPTS a list of wfs options, e.g. (\"--compress\")
+DIR the mount directory"
+  (make-directory dir :parents)
+  (string-join
+   (append (list "../solution/wfs") (gen-disks numdisks) opts (list "-s" dir))
+   " "))
+
+(defun fsck-cmd (&optional repair)
+  "Check every test disk with fsck.wfs on one thread, with -y if REPAIR."
+  (format "../solution/fsck.wfs %s-j 1 %s"
+	  (if repair "-y " "")
+	  (disk-path "test-disk*")))
+
+(defun fsck-summary (inodes blocks numdisks)
+  "The last line fsck.wfs prints for a consistent filesystem."
+  (format "fsck.wfs: %d inodes, %d data blocks, %d disks, 1 threads: 0 problems, 0 fixed"
+	  inodes blocks numdisks))
+
+(defun py-script (&rest lines)
+  "Python given on the command line, one of LINES per line."
+  (format "python3 -c '%s'" (string-join lines "\n")))
+
+(defun feature-test (desc mkfs-args wfs-opts numdisks op output)
+  "Test template for the optional filesystem features.
+
+The disks are formatted with MKFS-ARGS and mounted with WFS-OPTS. OP
+runs on the mounted filesystem, then it is unmounted and fsck.wfs checks
+the disks, so OUTPUT ends with its summary.
+
+DESC description of the test
+MKFS-ARGS mkfs arguments, including the disks
+WFS-OPTS list of wfs options for the first mount
+NUMDISKS the number of disks to create and mount
+OP the workload
+OUTPUT the expected output of OP and fsck.wfs"
+  (define-test
+   desc
+   (string-join
+    (list
+     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (concat "../solution/mkfs " mkfs-args)
+     (feature-mount-cmd numdisks wfs-opts "mnt"))
+    " && ")
+   (teardown-cmd)
+   (string-join (list op (umount-cmd "mnt") (fsck-cmd)) " && ")
+   output "0" "0" ""))
+
 ; returns (filesystem-init-success 2 "1" "desc" '(())
 (generate-tests
  `(((testcase . ,#'mkfs-test)
@@ -503,4 +555,356 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'feature-test)
+    ; desc mkfs-args wfs-opts numdisks op output
+    (configs . (("raid1 -- inline: small file is stored in the inode slot"
+		  ,(concat (default-fs-mkfs-args "1" 2) " -f inline")
+		  ,'() 2
+		  ,(string-join
+		    (list (py-script "import os"
+				     "os.chdir(\"mnt\")"
+				     "os.mknod(\"file1\")"
+				     "free = os.statvfs(\".\").f_bfree"
+				     "with open(\"file1\", \"wb\") as f:"
+				     "    f.write(b\"a\" * 100)"
+				     "if os.statvfs(\".\").f_bfree != free:"
+				     "    print(\"inline file took a data block\")"
+				     "    exit(1)"
+				     "print(\"Correct\")")
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 2 '() "mnt")
+			  (py-script "import os"
+				     "os.chdir(\"mnt\")"
+				     "with open(\"file1\", \"rb\") as f:"
+				     "    if f.read() != b\"a\" * 100:"
+				     "        print(\"file1 readback does not match data written\")"
+				     "        exit(1)"
+				     "with open(\"file1\", \"ab\") as f:"
+				     "    f.write(b\"b\" * 1000)"
+				     "with open(\"file1\", \"rb\") as f:"
+				     "    if f.read() != b\"a\" * 100 + b\"b\" * 1000:"
+				     "        print(\"file1 readback does not match data written\")"
+				     "        exit(1)"
+				     "print(\"Correct\")"))
+		    " && ")
+		  ,(concat "Correct\nCorrect\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- compact: readback after remount"
+		  ,(concat (default-fs-mkfs-args "1" 2) " -f compact")
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 4 20"
+			  "cat mnt/file4 > file4.test"
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 2 '() "mnt")
+			  "diff mnt/file4 file4.test"
+			  "./readdir-check.py 4")
+		    " && ")
+		  ,(concat "Correct\nCorrect\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- checksum: readback with a corrupted disk"
+		  ,(concat (default-fs-mkfs-args "1" 2) " -f checksum")
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  (umount-cmd "mnt")
+			  (format "./corrupt-disk.py --disks %s" (disk-path "test-disk1"))
+			  (feature-mount-cmd 2 '() "mnt")
+			  "diff mnt/file1 file1.test")
+		    " && ")
+		  ,(concat "Correct\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- scrub: repair a corrupted disk"
+		  ,(default-fs-mkfs-args "1" 3)
+		  ,'() 3
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  (umount-cmd "mnt")
+			  (format "./corrupt-disk.py --disks %s" (disk-path "test-disk1"))
+			  (feature-mount-cmd 3 '("--scrub-rate=100000") "mnt")
+			  (py-script "import time"
+				     "for i in range(100):"
+				     "    with open(\"mnt/.scrub\") as f:"
+				     "        status = f.read().split(\"\\n\")"
+				     "    if status[2] != \"passes: 0\":"
+				     "        break"
+				     "    time.sleep(0.1)"
+				     "print(\"\\n\".join(status[5:8]))")
+			  "diff mnt/file1 file1.test")
+		    " && ")
+		  ,(concat "Correct\nmismatches: 2\nrepaired: 2\nunrepairable: 0\n" (fsck-summary 32 224 3)))
+		 ("raid1 -- rebuild: restore a replaced disk"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 2 30"
+			  "cat mnt/file2 > file2.test"
+			  (umount-cmd "mnt")
+			  (format "rm %s" (disk-path "test-disk2"))
+			  (format "truncate -s 1M %s" (disk-path "test-disk2"))
+			  (concat (feature-mount-cmd 2 '("--rebuild") "mnt") " 2> /dev/null")
+			  "diff mnt/file2 file2.test"
+			  "./readdir-check.py 2")
+		    " && ")
+		  ,(concat "Correct\nCorrect\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- fsck: repair leaked inodes and blocks"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  (umount-cmd "mnt")
+			  (concat (py-script "import sys, wfsverify"
+				     "for disk in sys.argv[1:]:"
+				     "    fs = wfsverify.WfsState(disk)"
+				     "    with open(disk, \"r+b\") as f:"
+				     "        f.seek(fs.get_ibit() + 3)"
+				     "        f.write(b\"\\x80\")"
+				     "        f.seek(fs.get_dbit() + 12)"
+				     "        f.write(b\"\\x10\")") " " (disk-path "test-disk1") " " (disk-path "test-disk2"))
+			  (fsck-cmd)
+			  (fsck-cmd t)
+			  (feature-mount-cmd 2 '() "mnt")
+			  "diff mnt/file1 file1.test")
+		    "; ")
+		  ,(concat "Correct\ninode 31: allocated but not reachable (mode 0)\nblock 100 on disk 0: allocated but not referenced\ndisk 0: stale free space counters (221 free blocks recorded)\ndisk 1: stale free space counters (221 free blocks recorded)\nfsck.wfs: 32 inodes, 224 data blocks, 2 disks, 1 threads: 4 problems, 0 fixed\ninode 31: allocated but not reachable (mode 0)\nblock 100 on disk 0: allocated but not referenced\nfsck.wfs: 32 inodes, 224 data blocks, 2 disks, 1 threads: 2 problems, 2 fixed\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- compress: compressible file takes one block"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'("--compress") 2
+		  ,(string-join
+		    (list (py-script "import os"
+				     "os.chdir(\"mnt\")"
+				     "os.mknod(\"file1\")"
+				     "free = os.statvfs(\".\").f_bfree"
+				     "with open(\"file1\", \"wb\") as f:"
+				     "    f.write(b\"abcdefgh\" * 400)"
+				     "print(free - os.statvfs(\".\").f_bfree)"
+				     "with open(\"file1\", \"rb\") as f:"
+				     "    if f.read() != b\"abcdefgh\" * 400:"
+				     "        print(\"file1 readback does not match data written\")"
+				     "        exit(1)"
+				     "print(\"Correct\")")
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 2 '() "mnt")
+			  (py-script "with open(\"mnt/file1\", \"rb\") as f:"
+				     "    if f.read() != b\"abcdefgh\" * 400:"
+				     "        print(\"file1 readback does not match data written\")"
+				     "        exit(1)"
+				     "print(\"Correct\")"))
+		    " && ")
+		  ,(concat "1\nCorrect\nCorrect\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- dedup: identical blocks are stored once"
+		  ,(concat (default-fs-mkfs-args "1" 2) " -f dedup")
+		  ,'() 2
+		  ,(py-script "import os"
+				     "os.chdir(\"mnt\")"
+				     "data = bytes(range(256)) * 4"
+				     "with open(\"file1\", \"wb\") as f:"
+				     "    f.write(data)"
+				     "os.mknod(\"file2\")"
+				     "free = os.statvfs(\".\").f_bfree"
+				     "with open(\"file2\", \"wb\") as f:"
+				     "    f.write(data)"
+				     "print(free - os.statvfs(\".\").f_bfree)"
+				     "with open(\"file2\", \"r+b\") as f:"
+				     "    f.write(b\"x\")"
+				     "print(free - os.statvfs(\".\").f_bfree)"
+				     "os.unlink(\"file1\")"
+				     "with open(\"file2\", \"rb\") as f:"
+				     "    if f.read() != b\"x\" + data[1:]:"
+				     "        print(\"file2 readback does not match data written\")"
+				     "        exit(1)"
+				     "print(\"Correct\")")
+		  ,(concat "0\n1\nCorrect\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- snapshot: old contents stay readable"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  "mkdir mnt/.snapshots mnt/.snapshots/s1"
+			  "./read-write.py 1 20"
+			  "diff mnt/.snapshots/s1/file1 file1.test"
+			  (py-script "try:"
+				     "    open(\"mnt/.snapshots/s1/file1\", \"wb\")"
+				     "except OSError as e:"
+				     "    print(e.strerror)")
+			  "rmdir mnt/.snapshots/s1"
+			  "ls mnt/.snapshots")
+		    " && ")
+		  ,(concat "Correct\nCorrect\nRead-only file system\n" (fsck-summary 32 224 2)))
+		 ("raid0 -- truncate and fallocate with holes"
+		  ,(default-fs-mkfs-args "0" 3)
+		  ,'() 3
+		  ,(string-join
+		    (list "./read-write.py 1 30"
+			  "truncate -s 1000 mnt/file1"
+			  "stat -c %s mnt/file1"
+			  "truncate -s 2500 mnt/file1"
+			  "cmp -i 1000:0 -n 1500 mnt/file1 /dev/zero"
+			  "fallocate -l 3584 mnt/file1"
+			  "stat -c %s mnt/file1"
+			  "fallocate -p -o 512 -l 1024 mnt/file1"
+			  "cmp -i 512:0 -n 1024 mnt/file1 /dev/zero")
+		    " && ")
+		  ,(concat "Correct\n1000\n3584\n" (fsck-summary 32 224 3)))
+		 ("raid0 -- discard: freed blocks leave the disk images"
+		  ,(default-fs-mkfs-args "0" 3)
+		  ,'("--discard") 3
+		  ,(string-join
+		    (list (concat (py-script "import os, sys"
+				     "names = [\"mnt/file%d\" % (n + 1) for n in range(20)]"
+				     "for name in names:"
+				     "    with open(name, \"wb\") as f:"
+				     "        f.write(os.urandom(3000))"
+				     "full = os.stat(sys.argv[1]).st_blocks"
+				     "for name in names:"
+				     "    os.unlink(name)"
+				     "if os.stat(sys.argv[1]).st_blocks >= full:"
+				     "    print(\"disk image did not shrink\")"
+				     "    exit(1)"
+				     "print(\"Correct\")") " " (disk-path "test-disk1"))
+			  "./read-write.py 2 10")
+		    " && ")
+		  ,(concat "Correct\nCorrect\n" (fsck-summary 32 224 3)))
+		 ("raid1 -- statfs: counters follow allocations"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'() 2
+		  ,(string-join
+		    (list (py-script "import os"
+				     "def show():"
+				     "    s = os.statvfs(\"mnt\")"
+				     "    print(s.f_bsize, s.f_blocks, s.f_bfree, s.f_files, s.f_ffree)"
+				     "show()"
+				     "with open(\"mnt/file1\", \"wb\") as f:"
+				     "    f.write(b\"a\" * 1024)"
+				     "os.mkdir(\"mnt/d1\")"
+				     "show()"
+				     "os.unlink(\"mnt/file1\")"
+				     "show()")
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 2 '() "mnt")
+			  (py-script "import os"
+				     "s = os.statvfs(\"mnt\")"
+				     "print(s.f_bsize, s.f_blocks, s.f_bfree, s.f_files, s.f_ffree)"))
+		    " && ")
+		  ,(concat "512 224 224 32 31\n512 224 221 32 29\n512 224 223 32 30\n512 224 223 32 30\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- large directory beyond the inode's blocks"
+		  ,(make-mkfs-args "1" 2 256 512)
+		  ,'() 2
+		  ,(string-join
+		    (list (py-script "import os"
+				     "for n in range(200):"
+				     "    os.mknod(\"mnt/file%d\" % (n + 1))")
+			  "./readdir-check.py 200"
+			  (py-script "import os"
+				     "for n in range(100, 200):"
+				     "    os.unlink(\"mnt/file%d\" % (n + 1))")
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 2 '() "mnt")
+			  "./readdir-check.py 100"
+			  "stat -c %F mnt/file77")
+		    " && ")
+		  ,(concat "Correct\nCorrect\nregular empty file\n" (fsck-summary 256 512 2)))
+		 ("raid1 -- lowlevel: workload through the inode-based frontend"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'("--lowlevel") 2
+		  ,(string-join
+		    (list "./read-write.py 3 20"
+			  "cat mnt/file3 > file3.test"
+			  "rm mnt/file2"
+			  "mkdir mnt/d1 mnt/d1/d2"
+			  "rmdir mnt/d1/d2 mnt/d1"
+			  (py-script "import errno, os"
+				     "fd = os.open(\"mnt/file1\", os.O_RDWR)"
+				     "os.unlink(\"mnt/file1\")"
+				     "for op in (lambda: os.pread(fd, 10, 0), lambda: os.pwrite(fd, b\"x\", 0)):"
+				     "    try:"
+				     "        op()"
+				     "        print(\"unlinked file is still usable\")"
+				     "    except OSError as e:"
+				     "        if e.errno != errno.ESTALE:"
+				     "            print(e)"
+				     "os.close(fd)"
+				     "print(\"Correct\")")
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 2 '("--lowlevel") "mnt")
+			  "diff mnt/file3 file3.test"
+			  "ls mnt")
+		    " && ")
+		  ,(concat "Correct\nCorrect\nfile3\n" (fsck-summary 32 224 2)))
+		 ("raid0 -- weighted stripes over disks of two sizes"
+		  ,(format "-r 0 -d %s -d %s -i 32 -b 200,400 -w 1,2" (disk-path "test-disk1") (disk-path "test-disk2"))
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 6 30"
+			  (umount-cmd "mnt")
+			  (concat (py-script "import sys, wfsverify"
+				     "for disk in sys.argv[1:]:"
+				     "    print(len(wfsverify.WfsState(disk).list_allocated_datablocks()))") " " (disk-path "test-disk1") " " (disk-path "test-disk2"))
+			  (feature-mount-cmd 2 '() "mnt")
+			  "./readdir-check.py 6")
+		    " && ")
+		  ,(concat "Correct\n17\n20\nCorrect\n" (fsck-summary 32 416 2)))
+		 ("raid0 -- restripe onto an added disk"
+		  ,(default-fs-mkfs-args "0" 2)
+		  ,'() 2
+		  ,(string-join
+		    (list "./read-write.py 4 30"
+			  "cat mnt/file4 > file4.test"
+			  (format "truncate -s 1M %s" (disk-path "test-disk3"))
+			  (format "echo \"add %s\" > mnt/.restripe" (disk-path "test-disk3"))
+			  (py-script "import time"
+				     "for i in range(100):"
+				     "    with open(\"mnt/.restripe\") as f:"
+				     "        status = f.read()"
+				     "    if status.startswith(\"state: done\"):"
+				     "        break"
+				     "    time.sleep(0.1)"
+				     "print(status, end=\"\")")
+			  "diff mnt/file4 file4.test"
+			  (umount-cmd "mnt")
+			  (feature-mount-cmd 3 '() "mnt")
+			  "diff mnt/file4 file4.test"
+			  "./readdir-check.py 4")
+		    " && ")
+		  ,(concat "Correct\nstate: done\ndisks: 3\nposition: 448/448\nmoved: 23\nCorrect\n" (fsck-summary 32 224 3)))
+		 ("raid0 -- metadata on a separate mirrored tier"
+		  ,(format "-r 0 -d %s -d %s -m %s -m %s -i 32 -b 200" (disk-path "test-disk1") (disk-path "test-disk2") (disk-path "test-disk3") (disk-path "test-disk4"))
+		  ,'() 4
+		  ,(string-join
+		    (list "mkdir mnt/d1"
+			  "./read-write.py 3 20"
+			  "cat mnt/file3 > file3.test"
+			  (umount-cmd "mnt")
+			  (format "../solution/wfs %s %s %s %s -s mnt" (disk-path "test-disk3") (disk-path "test-disk1") (disk-path "test-disk4") (disk-path "test-disk2"))
+			  "diff mnt/file3 file3.test"
+			  "ls mnt")
+		    " && ")
+		  ,(concat "Correct\nd1\nfile1\nfile2\nfile3\n" (fsck-summary 32 224 2)))
+		 ("raid1 -- mem-budget: mirrored writes stay within the window budget"
+		  ,(default-fs-mkfs-args "1" 2)
+		  ,'() 2
+		  ,(string-join
+		    (list (umount-cmd "mnt")
+			  (format "truncate -s 24M %s %s" (disk-path "test-disk1") (disk-path "test-disk2"))
+			  (concat "../solution/mkfs " (make-mkfs-args "1" 2 4096 32768) " > /dev/null")
+			  (feature-mount-cmd 2 '("--mem-budget=2M") "mnt")
+			  (py-script "import os"
+				     "def rss():"
+				     "    for pid in filter(str.isdigit, os.listdir(\"/proc\")):"
+				     "        with open(\"/proc/%s/cmdline\" % pid, \"rb\") as f:"
+				     "            if not f.read().startswith(b\"../solution/wfs\"):"
+				     "                continue"
+				     "        with open(\"/proc/%s/status\" % pid) as f:"
+				     "            return int([l for l in f if l.startswith(\"VmRSS\")][0].split()[1])"
+				     "start = rss()"
+				     "for i in range(3000):"
+				     "    with open(\"mnt/file%d\" % i, \"wb\") as f:"
+				     "        f.write(os.urandom(4096))"
+				     "if rss() - start > 8192:"
+				     "    print(\"wfs grew by %d KiB with a 2 MiB budget\" % (rss() - start))"
+				     "    exit(1)"
+				     "print(\"Correct\")"))
+		    " && ")
+		  ,(concat "Correct\n" (fsck-summary 4096 32768 2))))))))